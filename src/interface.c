@@ -45,6 +45,7 @@
 #define MAX_COEFF	  (3000)
 #define MAX_RIGIDITY      (1000)
 #define MAX_DELTA_X         (10)
+#define MAX_PYRAMID_FACTOR  (16)
 #define MAX_STRING_SIZE   (2048)
 
 
@@ -65,7 +66,8 @@ static void callback_output_target_changed (GtkWidget * res_order, gpointer data
 static void callback_scaleback_mode_changed (GtkWidget * res_order, gpointer data);
 static void callback_expander_changed (GtkWidget * expander, gpointer data);
 
-static void callback_out_seams_button (GtkWidget * button, gpointer data);
+static void callback_other_layers_changed (GtkWidget * combo, gpointer data);
+static void callback_out_seams_changed (GtkWidget * combo, gpointer data);
 static void callback_out_seams_col_button1 (GtkWidget * button, gpointer data);
 static void callback_out_seams_col_button2 (GtkWidget * button, gpointer data);
 static void callback_scaleback_button (GtkWidget * button, gpointer data);
@@ -154,8 +156,15 @@ dialog (PlugInImageVals * image_vals,
   GtkWidget *output_target_combo_box;
   GtkWidget *resize_canvas_button;
   GtkWidget *resize_aux_layers_button;
+  GtkWidget *other_layers_event_box;
+  GtkWidget *other_layers_hbox;
+  GtkWidget *other_layers_label;
+  GtkWidget *other_layers_combo_box;
   GtkWidget *out_seams_hbox;
-  GtkWidget *out_seams_button;
+  GtkWidget *out_seams_event_box;
+  GtkWidget *out_seams_combo_hbox;
+  GtkWidget *out_seams_label;
+  GtkWidget *out_seams_combo_box;
   GimpRGB *colour;
   GtkWidget *out_seams_col_button1;
   GtkWidget *out_seams_col_button2;
@@ -599,28 +608,100 @@ dialog (PlugInImageVals * image_vals,
 			   ("Resize the layers used as features or rigidity masks "
 			    "along with the active layer"), NULL);
 
+  other_layers_event_box = gtk_event_box_new ();
+  gtk_box_pack_start (GTK_BOX (vbox), other_layers_event_box, FALSE, FALSE, 0);
+  gtk_widget_show (other_layers_event_box);
+
+  gimp_help_set_help_data (other_layers_event_box,
+			   _("Rescale other layers along with the active one, "
+			     "removing the same seams from all of them. "
+			     "Layer groups and the layers used as masks are "
+			     "left alone.\n"
+			     "Note that this option is ignored in interactive mode"), NULL);
+
+  other_layers_hbox = gtk_hbox_new (FALSE, 4);
+  gtk_container_add (GTK_CONTAINER (other_layers_event_box), other_layers_hbox);
+  gtk_widget_show (other_layers_hbox);
+
+  other_layers_label = gtk_label_new (_("Also rescale:"));
+  gtk_box_pack_start (GTK_BOX (other_layers_hbox), other_layers_label, FALSE, FALSE, 0);
+  gtk_widget_show (other_layers_label);
+
+  other_layers_combo_box =
+    gimp_int_combo_box_new (_("no other layers"), OTHER_LAYERS_NONE,
+			    _("linked layers"), OTHER_LAYERS_LINKED,
+			    _("all layers"), OTHER_LAYERS_ALL,
+			    NULL);
+
+  gimp_int_combo_box_connect (GIMP_INT_COMBO_BOX (other_layers_combo_box),
+			      state->other_layers,
+			      G_CALLBACK (callback_other_layers_changed),
+			      (gpointer) &(state->other_layers));
+
+  gtk_box_pack_start (GTK_BOX (other_layers_hbox), other_layers_combo_box, FALSE, FALSE, 0);
+  gtk_widget_show (other_layers_combo_box);
+
   out_seams_hbox = gtk_hbox_new (FALSE, 4);
   gtk_box_pack_start (GTK_BOX (vbox), out_seams_hbox, FALSE, FALSE, 0);
   gtk_widget_show (out_seams_hbox);
 
-  out_seams_button = gtk_check_button_new_with_label (_("Output the seams"));
-
-  gtk_box_pack_start (GTK_BOX (out_seams_hbox), out_seams_button, FALSE,
+  out_seams_event_box = gtk_event_box_new ();
+  gtk_box_pack_start (GTK_BOX (out_seams_hbox), out_seams_event_box, FALSE,
 		      FALSE, 0);
-  gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (out_seams_button),
-				state->output_seams);
-  gtk_widget_show (out_seams_button);
+  gtk_widget_show (out_seams_event_box);
 
-  gimp_help_set_help_data (out_seams_button,
+  gimp_help_set_help_data (out_seams_event_box,
 			   _("Creates an extra output layer with the seams, "
 			     "for visual inspection of what the plugin did. "
 			     "Use it together with \"Output on a new layer\", "
 			     "and resize in one direction at a time.\n"
+			     "Depth maps are put in a new grayscale image, and "
+			     "store for each pixel the number of the seam which "
+			     "removed it (0 if none).\n"
 			     "Note that this option is ignored in interactive mode"), NULL);
 
-  g_signal_connect (out_seams_button, "toggled",
-		    G_CALLBACK (callback_out_seams_button),
-		    (gpointer) &(state->output_seams));
+  out_seams_combo_hbox = gtk_hbox_new (FALSE, 4);
+  gtk_container_add (GTK_CONTAINER (out_seams_event_box), out_seams_combo_hbox);
+  gtk_widget_show (out_seams_combo_hbox);
+
+  out_seams_label = gtk_label_new (_("Output the seams:"));
+  gtk_box_pack_start (GTK_BOX (out_seams_combo_hbox), out_seams_label, FALSE, FALSE, 0);
+  gtk_widget_show (out_seams_label);
+
+#ifdef HAVE_GIMP_2_10
+  out_seams_combo_box =
+    gimp_int_combo_box_new (_("no"), SEAMS_OUTPUT_NONE,
+			    _("colour map"), SEAMS_OUTPUT_COLOUR,
+			    _("depth map (8 bit)"), SEAMS_OUTPUT_DEPTH_8,
+			    _("depth map (16 bit)"), SEAMS_OUTPUT_DEPTH_16,
+			    NULL);
+#else
+  out_seams_combo_box =
+    gimp_int_combo_box_new (_("no"), SEAMS_OUTPUT_NONE,
+			    _("colour map"), SEAMS_OUTPUT_COLOUR,
+			    _("depth map"), SEAMS_OUTPUT_DEPTH_8,
+			    NULL);
+#endif /* HAVE_GIMP_2_10 */
+
+  gimp_int_combo_box_connect (GIMP_INT_COMBO_BOX (out_seams_combo_box),
+			      state->output_seams,
+			      G_CALLBACK (callback_out_seams_changed),
+			      (gpointer) &(state->output_seams));
+
+  gtk_box_pack_start (GTK_BOX (out_seams_combo_hbox), out_seams_combo_box, FALSE, FALSE, 0);
+  gtk_widget_show (out_seams_combo_box);
+
+#ifdef HAVE_GIMP_2_10
+  gimp_help_set_help_data (out_seams_combo_box,
+			   _("Colour maps and 8 bit depth maps only keep up to "
+			     "126 and 255 seams: use a 16 bit depth map to apply "
+			     "the seams again later"), NULL);
+#else
+  gimp_help_set_help_data (out_seams_combo_box,
+			   _("Colour maps and depth maps only keep up to "
+			     "126 and 255 seams, for applying them again later"),
+			   NULL);
+#endif /* HAVE_GIMP_2_10 */
 
 
   colour = g_new (GimpRGB, 1);
@@ -997,10 +1078,15 @@ callback_interactive_button (GtkWidget * button, gpointer data)
 
 
 static void
-callback_out_seams_button (GtkWidget * button, gpointer data)
+callback_other_layers_changed (GtkWidget * combo, gpointer data)
 {
-  *((gboolean*) data) =
-    gtk_toggle_button_get_active (GTK_TOGGLE_BUTTON (button));
+  gimp_int_combo_box_get_active (GIMP_INT_COMBO_BOX (combo), (gint *) data);
+}
+
+static void
+callback_out_seams_changed (GtkWidget * combo, gpointer data)
+{
+  gimp_int_combo_box_get_active (GIMP_INT_COMBO_BOX (combo), (gint *) data);
 }
 
 static void
@@ -1143,6 +1229,7 @@ features_page_new (gint32 image_ID, gint32 layer_ID)
   GtkWidget *pres_button;
   GtkWidget *pres_new_button;
   GtkWidget *pres_edit_button;
+  GtkWidget *pres_alpha_button;
   GtkWidget *disc_vbox;
   GtkWidget *disc_vbox2;
   GtkWidget *disc_button;
@@ -1447,6 +1534,26 @@ features_page_new (gint32 image_ID, gint32 layer_ID)
   pres_toggle_data.guess_button_hor = NULL;
   pres_toggle_data.guess_button_ver = NULL;
 
+  /* the alpha channel of the layer itself can be used as
+   * well, without any extra layer */
+  pres_alpha_button =
+    gtk_check_button_new_with_label (_("Preserve the opaque areas"));
+  gtk_box_pack_start (GTK_BOX (pres_vbox), pres_alpha_button, FALSE, FALSE, 0);
+  gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (pres_alpha_button),
+				state->pres_from_alpha);
+  gtk_widget_set_sensitive (pres_alpha_button,
+			    gimp_drawable_has_alpha (layer_ID));
+  gtk_widget_show (pres_alpha_button);
+
+  g_signal_connect (pres_alpha_button, "toggled",
+		    G_CALLBACK (gimp_toggle_button_update),
+		    &state->pres_from_alpha);
+
+  gimp_help_set_help_data (pres_alpha_button,
+			   _("Use the alpha channel of the layer as a "
+			     "preservation mask, with the strength set above"),
+			   NULL);
+
 
   /*  Feature discard  */
 
@@ -1919,6 +2026,22 @@ advanced_page_new (gint32 image_ID, gint32 layer_ID)
 		    G_CALLBACK (gimp_float_adjustment_update),
 		    &state->rigidity);
 
+  /* Pyramid factor */
+
+  adj = gimp_scale_entry_new (GTK_TABLE (table), 0, row++,
+			      _("Coarse search factor:"), SCALE_WIDTH,
+			      SPIN_BUTTON_WIDTH, state->pyramid_factor, 1,
+			      MAX_PYRAMID_FACTOR, 1, 1, 0, TRUE, 0, 0,
+			      _("Search the seams on a copy of the layer "
+				"scaled down by this factor, then refine "
+				"them at full size. Much faster on very "
+				"large images, when shrinking in a single "
+				"direction. 1 means an exact search"), NULL);
+
+  g_signal_connect (adj, "value_changed",
+		    G_CALLBACK (gimp_int_adjustment_update),
+		    &state->pyramid_factor);
+
 
   hbox = gtk_hbox_new (FALSE, 4);
   gtk_box_pack_start (GTK_BOX (rigmask_vbox), hbox, FALSE, FALSE, 0);
@@ -32,6 +32,7 @@
 #include "main_common.h"
 #include "main.h"
 #include "render.h"
+#include "scratch.h"
 #include "interface_I.h"
 #include "preview.h"
 #include "layers_combo.h"
@@ -425,6 +426,7 @@ dialog_I (PlugInImageVals * image_vals,
 
 
   lqr_carver_destroy (carver_data->carver);
+  scratch_free_all ();
 
   switch (dialog_I_response)
     {
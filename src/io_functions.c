@@ -16,299 +16,2838 @@
  * along with this program; if not, see <http://www.gnu.org.licences/>.
  */
 
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include <glib/gstdio.h>
 #include <libgimp/gimp.h>
 #include <lqr.h>
 
 #include "config.h"
 #include "plugin-intl.h"
 
+#include "progress.h"
+#include "scratch.h"
+#include "seam_cache.h"
 #include "io_functions.h"
 
+/* Destination of the pixels written back to a layer: either a
+ * legacy pixel region or a GEGL buffer with an explicit format.
+ * Unless direct is set, the pixels go through the layer's shadow */
+
+typedef struct
+{
+  gint32 layer_ID;
+  gint w;
+  gint h;
+  gboolean direct;
+#ifdef HAVE_GIMP_2_10
+  GeglBuffer *buffer;
+  const Babl *format;
+#else
+  GimpDrawable *drawable;
+  GimpPixelRgn rgn;
+#endif
+} LayerSink;
+
+/* Destination of the pixels written to a PAM (netpbm) file, one
+ * row at a time; samples are stored as non-linear 8 bit, or 16 bit
+ * big-endian, values */
+
+typedef struct
+{
+  FILE *fp;
+  gchar *filename;
+  gint w;
+  gint channels;
+  gint sample_size;
+  guchar *row;
+#ifdef HAVE_GIMP_2_10
+  const Babl *fish;
+#endif
+} FileSink;
+
+/* A mask layer, clipped to the carver, with its weight */
+
+typedef struct
+{
+  MaskTileList *mask;
+  gint x_off;
+  gint y_off;
+  gint coeff;
+} MaskSource;
+
+/* The masks read for one carver job, and the area which they
+ * cover (x1, y1, x2, y2, in carver coordinates) */
+
+typedef struct
+{
+  MaskSource src[2];
+  gint n;
+  gint x1;
+  gint y1;
+  gint x2;
+  gint y2;
+} MaskSet;
+
+typedef enum
+{
+  CARVER_JOB_INIT,
+  CARVER_JOB_BIAS,
+  CARVER_JOB_ALPHA_BIAS,
+  CARVER_JOB_RIGMASK,
+  CARVER_JOB_LOAD_VMAP
+} CarverJobType;
+
+/* pixels, channels, col_depth and coeff are only used by
+ * CARVER_JOB_ALPHA_BIAS, vmap by CARVER_JOB_LOAD_VMAP */
+
+typedef struct
+{
+  CarverJobType type;
+  MaskSet masks;
+  gconstpointer pixels;
+  gint channels;
+  LqrColDepth col_depth;
+  gint coeff;
+  LqrVMap *vmap;
+} CarverJob;
+
+/* ret is only touched by the jobs, read_ret only by the main
+ * thread; while holding, the jobs are kept (in reverse order)
+ * in held instead of being run */
+
+struct _CarverSetup
+{
+  LqrCarver *r;
+  gint width;
+  gint height;
+  gint tile_w;
+  gint tile_h;
+  gint delta_x;
+  gfloat rigidity;
+  LqrRetVal ret;
+  LqrRetVal read_ret;
+  GChecksum *checksum;
+  gboolean holding;
+  GSList *held;
+#if GLIB_CHECK_VERSION (2, 36, 0)
+  GThreadPool *pool;
+#endif /* GLIB_CHECK_VERSION (2, 36, 0) */
+};
+
+/* A carved pixel of a seam map being read back, with its
+ * position in the map */
+
+typedef struct
+{
+  gint value;
+  gint index;
+} VMapRank;
+
+/* The state of the projection of a coarse seam map: the full size
+ * map, filled in seam by seam, and, for the seam being traced, the
+ * band of pixels which it may go through in each line */
+
+typedef struct
+{
+  gconstpointer pixels;
+  gint width;
+  gint height;
+  gint channels;
+  gint n_colours;
+  LqrColDepth col_depth;
+  gint orientation;
+  gint lines;
+  gint len;
+  gint delta_x;
+  gint *data;                   /* the map, 0 where not carved yet */
+  gint *carved;                 /* Fenwick trees of the carved pixels of each line */
+  gint *start;                  /* where the band of each line begins in the arrays below */
+  gint *pos;                    /* the position of each pixel of the bands in its line */
+  gint *cur;                    /* and in the line as carved so far */
+  gfloat *cost;                 /* the lowest energy of a seam ending there */
+  gint *from;                   /* and where it comes from in the line before */
+  gsize size;
+} VMapTrace;
+
+/* static functions declarations */
+
+static LqrRetVal write_carver_rect (LqrCarver * r, gint32 layer_ID,
+                                    gint x0, gint y0, gint w, gint h,
+                                    gboolean direct);
+static void layer_sink_open (LayerSink * sink, gint32 layer_ID, LqrColDepth col_depth,
+                             gboolean direct);
+static void layer_sink_set_rect (LayerSink * sink, guchar * data,
+                                 gint x, gint y, gint w, gint h);
+static void layer_sink_close (LayerSink * sink);
+static LqrRetVal file_sink_open (FileSink * sink, const gchar * filename,
+                                 gint32 layer_ID, gint w, gint h,
+                                 gint channels, LqrColDepth col_depth);
+static gboolean file_sink_write_row (FileSink * sink, const guchar * src);
+static LqrRetVal file_sink_close (FileSink * sink);
+static guint32 * vmap_colour_table_new (gint depth, GimpRGB col_start,
+                                        GimpRGB col_end);
+static void vmap_colour_row (guint32 * dest, const gint * src, gint w,
+                             const guint32 * table);
+static guint32 * vmap_rasterize (LqrVMap * vmap, GimpRGB col_start,
+                                 GimpRGB col_end);
+static gint32 vmap_layer_prepare (VMapFuncArg * arg, gint w, gint h);
+static void vmap_layer_upload (gint32 layer_ID, const guint32 * pixels,
+                               gint w, gint h);
+static LqrRetVal write_depth_map (LqrVMap * vmap, gint32 image_ID,
+                                  gchar * name, gboolean high_depth);
+static gint vmap_lines_depth (const gint * data, gint w, gint h,
+                              gint orientation);
+static gboolean vmap_lines_rank (gint * data, gint w, gint h, gint orientation,
+                                 gint depth, VMapRank * ranks);
+static int vmap_rank_compare (const void * a, const void * b);
+static LqrRetVal vmap_trace_seam (VMapTrace * t, const gint * coarse_pos,
+                                  gint coarse_lines, gint coarse_len,
+                                  gint margin, gint level);
+static gint vmap_trace_band (VMapTrace * t, gint line, gint lo, gint hi,
+                             gint n);
+static gboolean vmap_trace_reserve (VMapTrace * t, gsize size);
+static gfloat pixel_energy (VMapTrace * t, gint line, gint pos);
+static void carved_add (gint * tree, gint len, gint pos);
+static gint carved_count (const gint * tree, gint pos);
+#ifndef HAVE_GIMP_2_10
+static void rgb_buffer_read_area (gint32 layer_ID, gint x0, gint y0,
+                                  gint w, gint h, guchar * buffer);
+#endif /* HAVE_GIMP_2_10 */
+#ifdef HAVE_GIMP_2_10
+static LqrColDepth layer_col_depth (gint32 layer_ID);
+static const Babl * layer_format (gint32 layer_ID, LqrColDepth col_depth);
+static void layer_read_area (gint32 layer_ID, gint x0, gint y0, gint w, gint h,
+                             LqrColDepth col_depth, gpointer dest);
+#endif /* HAVE_GIMP_2_10 */
+
+static gboolean mask_area_clip (gint width, gint height, gint32 layer_ID,
+                                gint base_x_off, gint base_y_off,
+                                gint * x, gint * y, gint * w, gint * h,
+                                gint * x_off, gint * y_off);
+static gint count_tiles (gint x0, gint y0, gint w, gint h);
+static MaskTileList * mask_tiles_new (gint bpp, gint max_tiles);
+static gboolean mask_tiles_add (MaskTileList * mask, const guchar * src,
+                                gint rowstride, gint x, gint y, gint w, gint h);
+static MaskTileList * mask_tiles_read (gint32 layer_ID, gint x0, gint y0,
+                                       gint w, gint h, GHashTable * cache);
+static void mask_row_quantize (guchar * dest, const guchar * src, gint w,
+                               gint bpp);
+static const guchar * mask_tile_row (const MaskTile * tile, gint y,
+                                     guchar * buf);
+static gboolean mask_tiles_add_row (MaskTileList * mask, const guchar * src,
+                                    gint rowstride, gint x0, gint y, gint w,
+                                    gint h);
+static void bias_row_add (gdouble * dest, const guchar * src, gint w,
+                          gint coeff);
+static void carver_setup_push (CarverSetup * setup, CarverJob * job);
+static void carver_setup_masks (CarverSetup * setup, CarverJobType type,
+                                gint n_layers, const gint32 * layer_ID,
+                                const gint * coeff, gint base_x_off,
+                                gint base_y_off, GHashTable * cache);
+static void carver_job_run (gpointer job_p, gpointer setup_p);
+static void carver_job_free (CarverJob * job);
+static void carver_job_free_func (gpointer job, gpointer data);
+static void mask_set_hash (GChecksum * checksum, CarverJobType type,
+                           MaskSet * set);
+static LqrRetVal mask_set_read (MaskSet * set, gint width, gint height,
+                                gint n_layers, const gint32 * layer_ID,
+                                const gint * coeff, gint base_x_off,
+                                gint base_y_off, GHashTable * cache);
+static void mask_set_clear (MaskSet * set);
+static LqrRetVal bias_apply (LqrCarver * r, MaskSet * set,
+                             gint tile_w, gint tile_h);
+static LqrRetVal alpha_bias_apply (LqrCarver * r, CarverJob * job,
+                                   gint width, gint height, gint stripe_h);
+static gdouble sample_value (gconstpointer pixels, gsize i,
+                             LqrColDepth col_depth);
+static LqrRetVal rigmask_apply (LqrCarver * r, MaskSet * set,
+                                gint tile_w, gint tile_h);
+
+
+/* Number of colour channels of a layer, independently of
+ * the precision of the image */
+gint
+layer_channels (gint32 layer_ID)
+{
+#ifdef HAVE_GIMP_2_10
+  return babl_format_get_n_components (gimp_drawable_get_format (layer_ID));
+#else
+  return gimp_drawable_bpp (layer_ID);
+#endif
+}
+
+/* Reads the whole layer in its own precision, which is returned
+ * in col_depth. Without GEGL support this is always 8 bit */
+gpointer
+native_buffer_from_layer (gint32 layer_ID, LqrColDepth * col_depth)
+{
+  return native_buffer_from_layer_area (layer_ID, 0, 0,
+                                        gimp_drawable_width (layer_ID),
+                                        gimp_drawable_height (layer_ID),
+                                        col_depth);
+}
+
+gpointer
+native_buffer_from_layer_area (gint32 layer_ID, gint x0, gint y0,
+                               gint w, gint h, LqrColDepth * col_depth)
+{
+#ifdef HAVE_GIMP_2_10
+  gpointer buffer;
+
+  *col_depth = layer_col_depth (layer_ID);
+
+  LQR_TRY_N_N (buffer = scratch_alloc ((gsize) w * h * layer_channels (layer_ID) *
+                                       col_depth_size (*col_depth)));
+
+  progress_task_start (_("Parsing layer..."));
+  layer_read_area (layer_ID, x0, y0, w, h, *col_depth, buffer);
+  progress_task_end ();
+
+  return buffer;
+#else
+  guchar *buffer;
+
+  *col_depth = LQR_COLDEPTH_8I;
+
+  LQR_TRY_N_N (buffer = scratch_alloc ((gsize) gimp_drawable_bpp (layer_ID) * w * h));
+  rgb_buffer_read_area (layer_ID, x0, y0, w, h, buffer);
+
+  return buffer;
+#endif /* HAVE_GIMP_2_10 */
+}
+
+/* lqr_carver_new_ext, for a buffer read by the functions above: a
+ * buffer mapped in the scratch directory is left to the caller, as
+ * liblqr would free it along with the carver otherwise */
+LqrCarver *
+carver_new_from_buffer (gpointer buffer, gint w, gint h, gint channels,
+                        LqrColDepth col_depth)
+{
+  LqrCarver *r;
+
+  r = lqr_carver_new_ext (buffer, w, h, channels, col_depth);
+  if ((r != NULL) && scratch_is_mapped (buffer))
+    {
+      lqr_carver_set_preserve_input_image (r);
+      scratch_lend (buffer);
+    }
+
+  return r;
+}
+
 guchar *
 rgb_buffer_from_layer (gint32 layer_ID)
 {
-  gint y, bpp;
-  gint w, h;
+  return rgb_buffer_from_layer_area (layer_ID, 0, 0,
+                                     gimp_drawable_width (layer_ID),
+                                     gimp_drawable_height (layer_ID));
+}
+
+guchar *
+rgb_buffer_from_layer_area (gint32 layer_ID, gint x0, gint y0, gint w, gint h)
+{
+#ifdef HAVE_GIMP_2_10
+  guchar *buffer;
+
+  LQR_TRY_N_N (buffer = g_try_new (guchar, layer_channels (layer_ID) * w * h));
+
+  progress_task_start (_("Parsing layer..."));
+  layer_read_area (layer_ID, x0, y0, w, h, LQR_COLDEPTH_8I, buffer);
+  progress_task_end ();
+
+  return buffer;
+#else
+  guchar *buffer;
+
+  LQR_TRY_N_N (buffer = g_try_new (guchar, gimp_drawable_bpp (layer_ID) * w * h));
+  rgb_buffer_read_area (layer_ID, x0, y0, w, h, buffer);
+
+  return buffer;
+#endif /* HAVE_GIMP_2_10 */
+}
+
+MaskTileList *
+mask_tiles_from_layer_area (gint32 layer_ID, gint x0, gint y0, gint w, gint h)
+{
+#ifdef HAVE_GIMP_2_10
+  guchar *stripe;
+  MaskTileList *mask;
+  gint bpp;
+  gint y, th, tile_h;
+
+  bpp = layer_channels (layer_ID);
+  tile_h = gimp_tile_height ();
+
+  LQR_TRY_N_N (mask = mask_tiles_new (bpp, count_tiles (x0, y0, w, h)));
+  stripe = g_try_new (guchar, w * tile_h * bpp);
+  if (stripe == NULL)
+    {
+      mask_tiles_free (mask);
+      return NULL;
+    }
+
+  progress_task_start (_("Parsing layer..."));
+
+  /* the area is fetched one row of tiles at a time, so that
+   * only the quantized tiles outlive the read */
+  for (y = y0; y < y0 + h; y += th)
+    {
+      th = MIN (tile_h - y % tile_h, y0 + h - y);
+      layer_read_area (layer_ID, x0, y, w, th, LQR_COLDEPTH_8I, stripe);
+      if (!mask_tiles_add_row (mask, stripe, w * bpp, x0, y - y0, w, th))
+        {
+          g_free (stripe);
+          progress_task_end ();
+          mask_tiles_free (mask);
+          return NULL;
+        }
+      progress_task_update ((gdouble) (y + th - y0) / h);
+    }
+
+  g_free (stripe);
+
+  progress_task_end ();
+
+  return mask;
+#else
   GimpDrawable *drawable;
   GimpPixelRgn rgn_in;
-  guchar *buffer;
+  gpointer pr;
+  MaskTileList *mask;
+  gint ntiles, tiles_done;
   gint update_step;
 
-  gimp_progress_init (_("Parsing layer..."));
-
-  w = gimp_drawable_width (layer_ID);
-  h = gimp_drawable_height (layer_ID);
+  progress_task_start (_("Parsing layer..."));
 
-  bpp = gimp_drawable_bpp (layer_ID);
+  ntiles = count_tiles (x0, y0, w, h);
 
-  LQR_TRY_N_N (buffer = g_try_new (guchar, bpp * w * h));
+  LQR_TRY_N_N (mask = mask_tiles_new (gimp_drawable_bpp (layer_ID), ntiles));
 
   drawable = gimp_drawable_get (layer_ID);
 
-  gimp_pixel_rgn_init (&rgn_in, drawable, 0, 0, w, h, FALSE, FALSE);
+  gimp_pixel_rgn_init (&rgn_in, drawable, x0, y0, w, h, FALSE, FALSE);
 
-  for (y = 0; y < h; y++)
+  update_step = MAX (ntiles / 20, 1);
+  tiles_done = 0;
+
+  /* tiles in which no pixel would have any effect are
+   * neither copied nor stored */
+  for (pr = gimp_pixel_rgns_register (1, &rgn_in); pr != NULL;
+       pr = gimp_pixel_rgns_process (pr))
     {
-      gimp_pixel_rgn_get_row (&rgn_in, buffer + y * w * bpp, 0, y, w);
+      if (!mask_tiles_add (mask, rgn_in.data, rgn_in.rowstride,
+                           rgn_in.x - x0, rgn_in.y - y0, rgn_in.w, rgn_in.h))
+        {
+          gimp_drawable_detach (drawable);
+          progress_task_end ();
+          mask_tiles_free (mask);
+          return NULL;
+        }
 
-      update_step = MAX ((h - 1) / 20, 1);
-      if (y % update_step == 0)
+      tiles_done++;
+      if (tiles_done % update_step == 0)
         {
-          gimp_progress_update ((gdouble) y / (h - 1));
+          progress_task_update ((gdouble) tiles_done / ntiles);
         }
     }
 
   gimp_drawable_detach (drawable);
 
-  gimp_progress_end();
+  progress_task_end ();
+
+  return mask;
+#endif /* HAVE_GIMP_2_10 */
+}
+
+/* Same as mask_tiles_from_layer_area, but reading from a buffer
+ * holding the whole layer (of width buf_w) */
+MaskTileList *
+mask_tiles_from_buffer (const guchar * buffer, gint buf_w, gint bpp,
+                        gint x0, gint y0, gint w, gint h)
+{
+  gint y;
+  gint tile_h;
+  gint th;
+  MaskTileList *mask;
+
+  tile_h = gimp_tile_height ();
+
+  LQR_TRY_N_N (mask = mask_tiles_new (bpp, count_tiles (x0, y0, w, h)));
+
+  for (y = y0; y < y0 + h; y += th)
+    {
+      th = MIN (tile_h - y % tile_h, y0 + h - y);
+      if (!mask_tiles_add_row (mask, buffer + (y * buf_w + x0) * bpp,
+                               buf_w * bpp, x0, y - y0, w, th))
+        {
+          mask_tiles_free (mask);
+          return NULL;
+        }
+    }
+
+  return mask;
+}
+
+void
+mask_tiles_free (MaskTileList * mask)
+{
+  gint i;
+
+  if (mask == NULL)
+    {
+      return;
+    }
+  for (i = 0; i < mask->n; i++)
+    {
+      g_free (mask->tiles[i].data);
+      g_free (mask->tiles[i].bits);
+    }
+  g_free (mask->tiles);
+  g_free (mask);
+}
+
+/* Per-run cache of whole layer buffers, keyed by drawable ID,
+ * used to read each layer only once when it is needed by more
+ * than one step */
+
+GHashTable *
+layer_cache_new (void)
+{
+  return g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+                                g_free);
+}
+
+/* Returns the buffer of the given layer, reading it if it is
+ * not in the cache yet. The cache keeps the ownership */
+guchar *
+layer_cache_get (GHashTable * cache, gint32 layer_ID)
+{
+  guchar *buffer;
+
+  buffer = g_hash_table_lookup (cache, GINT_TO_POINTER (layer_ID));
+  if (buffer == NULL)
+    {
+      LQR_TRY_N_N (buffer = rgb_buffer_from_layer (layer_ID));
+      g_hash_table_insert (cache, GINT_TO_POINTER (layer_ID), buffer);
+    }
+  return buffer;
+}
+
+/* Same as layer_cache_get, but the ownership of the buffer
+ * passes to the caller */
+guchar *
+layer_cache_steal (GHashTable * cache, gint32 layer_ID)
+{
+  guchar *buffer;
 
+  LQR_TRY_N_N (buffer = layer_cache_get (cache, layer_ID));
+  g_hash_table_steal (cache, GINT_TO_POINTER (layer_ID));
   return buffer;
 }
 
-LqrRetVal
-update_bias (LqrCarver * r, gint32 layer_ID, gint bias_factor,
-             gint base_x_off, gint base_y_off)
+void
+layer_cache_destroy (GHashTable * cache)
 {
-  guchar *rgb;
-  gint w, h, bpp;
-  gint x_off, y_off;
+  g_hash_table_destroy (cache);
+}
 
-  if ((layer_ID == 0) || (bias_factor == 0))
+/* Starts setting up a carver: lqr_carver_init and the submission of
+ * the masks run, in order, on a worker thread, so that they overlap
+ * with the reading of the mask layers, which stays on the main thread.
+ * Nothing but carver_setup_* may touch the carver until
+ * carver_setup_finish has returned.
+ * If a checksum is given, the masks are also hashed into it as they
+ * are read. Then, or if hold is set, nothing runs until
+ * carver_setup_release has told whether a visibility map is to be
+ * loaded instead */
+CarverSetup *
+carver_setup_start (LqrCarver * r, gint delta_x, gfloat rigidity,
+                    GChecksum * checksum, gboolean hold)
+{
+  CarverSetup *setup;
+  CarverJob *job;
+
+  LQR_TRY_N_N (setup = g_try_new0 (CarverSetup, 1));
+  setup->r = r;
+  setup->width = lqr_carver_get_width (r);
+  setup->height = lqr_carver_get_height (r);
+  /* read here, as the worker must not call GIMP */
+  setup->tile_w = gimp_tile_width ();
+  setup->tile_h = gimp_tile_height ();
+  setup->delta_x = delta_x;
+  setup->rigidity = rigidity;
+  setup->ret = LQR_OK;
+  setup->read_ret = LQR_OK;
+  setup->checksum = checksum;
+  setup->holding = hold || (checksum != NULL);
+
+#if GLIB_CHECK_VERSION (2, 36, 0)
+  /* a single worker, so that the jobs run in the order of submission;
+   * without it they run synchronously */
+  setup->pool = g_thread_pool_new (carver_job_run, setup, 1, FALSE, NULL);
+#endif /* GLIB_CHECK_VERSION (2, 36, 0) */
+
+  job = g_try_new0 (CarverJob, 1);
+  if (job == NULL)
     {
-      return LQR_OK;
+      carver_setup_finish (setup);
+      return NULL;
     }
+  job->type = CARVER_JOB_INIT;
+  carver_setup_push (setup, job);
 
-  gimp_drawable_offsets (layer_ID, &x_off, &y_off);
-  x_off -= base_x_off;
-  y_off -= base_y_off;
+  return setup;
+}
 
-  w = gimp_drawable_width (layer_ID);
-  h = gimp_drawable_height (layer_ID);
+/* Reads the preservation (with weight +pres_coeff) and discard (with
+ * weight -disc_coeff) masks, and queues their addition to the bias */
+void
+carver_setup_bias (CarverSetup * setup, gint32 pres_layer_ID, gint pres_coeff,
+                   gint32 disc_layer_ID, gint disc_coeff,
+                   gint base_x_off, gint base_y_off, GHashTable * cache)
+{
+  gint32 layer_ID[2];
+  gint coeff[2];
 
-  bpp = gimp_drawable_bpp (layer_ID);
+  layer_ID[0] = pres_layer_ID;
+  coeff[0] = pres_coeff;
+  layer_ID[1] = disc_layer_ID;
+  coeff[1] = -disc_coeff;
+
+  carver_setup_masks (setup, CARVER_JOB_BIAS, 2, layer_ID, coeff,
+                      base_x_off, base_y_off, cache);
+}
 
-  rgb = rgb_buffer_from_layer (layer_ID);
+/* Queues the addition of the alpha channel of the carver's own
+ * pixels to the bias, with weight +coeff, so that the opaque areas
+ * of a cut-out are preserved without any extra layer being read.
+ * pixels is the buffer the carver was created from */
+void
+carver_setup_alpha_bias (CarverSetup * setup, gconstpointer pixels,
+                         gint channels, LqrColDepth col_depth, gint coeff)
+{
+  CarverJob *job;
 
-  CATCH (lqr_carver_bias_add_rgb_area
-         (r, rgb, bias_factor, bpp, w, h, x_off, y_off));
+  if ((setup->read_ret != LQR_OK) || (coeff == 0))
+    {
+      return;
+    }
 
-  g_free(rgb);
+  job = g_try_new0 (CarverJob, 1);
+  if (job == NULL)
+    {
+      setup->read_ret = LQR_NOMEM;
+      return;
+    }
+  job->type = CARVER_JOB_ALPHA_BIAS;
+  job->pixels = pixels;
+  job->channels = channels;
+  job->col_depth = col_depth;
+  job->coeff = coeff;
+
+  /* the pixels themselves are hashed by the caller */
+  if (setup->checksum != NULL)
+    {
+      seam_cache_hash_int (setup->checksum, job->type);
+      seam_cache_hash_int (setup->checksum, coeff);
+    }
 
-  return LQR_OK;
+  carver_setup_push (setup, job);
 }
 
-LqrRetVal
-set_rigmask (LqrCarver * r, gint32 layer_ID, gint base_x_off, gint base_y_off)
+/* Reads the rigidity mask, and queues its addition */
+void
+carver_setup_rigmask (CarverSetup * setup, gint32 layer_ID,
+                      gint base_x_off, gint base_y_off, GHashTable * cache)
 {
-  guchar *rgb;
-  gint w, h, bpp;
-  gint x_off, y_off;
+  gint coeff = 1;
 
   if (layer_ID == 0)
     {
-      return LQR_OK;
+      return;
     }
 
-  gimp_drawable_offsets (layer_ID, &x_off, &y_off);
-  x_off -= base_x_off;
-  y_off -= base_y_off;
+  carver_setup_masks (setup, CARVER_JOB_RIGMASK, 1, &layer_ID, &coeff,
+                      base_x_off, base_y_off, cache);
+}
 
-  w = gimp_drawable_width (layer_ID);
-  h = gimp_drawable_height (layer_ID);
+/* Lets the held jobs run. If a visibility map is given, it is loaded
+ * (and then destroyed) in place of the initialization and the masks,
+ * which would only serve to find the seams which it already holds */
+void
+carver_setup_release (CarverSetup * setup, LqrVMap * vmap)
+{
+  GSList *jobs, *l;
+  CarverJob *job;
 
-  bpp = gimp_drawable_bpp (layer_ID);
+  if (!setup->holding)
+    {
+      return;
+    }
+  setup->holding = FALSE;
+  jobs = g_slist_reverse (setup->held);
+  setup->held = NULL;
+
+  if (vmap != NULL)
+    {
+      g_slist_foreach (jobs, carver_job_free_func, NULL);
+      job = g_try_new0 (CarverJob, 1);
+      if (job == NULL)
+        {
+          lqr_vmap_destroy (vmap);
+          setup->read_ret = LQR_NOMEM;
+        }
+      else
+        {
+          job->type = CARVER_JOB_LOAD_VMAP;
+          job->vmap = vmap;
+          carver_setup_push (setup, job);
+        }
+    }
+  else
+    {
+      for (l = jobs; l != NULL; l = l->next)
+        {
+          carver_setup_push (setup, l->data);
+        }
+    }
+
+  g_slist_free (jobs);
+}
 
-  rgb = rgb_buffer_from_layer (layer_ID);
+/* Waits for the queued jobs and frees the setup; returns the
+ * first error met, either while reading or in the carver */
+LqrRetVal
+carver_setup_finish (CarverSetup * setup)
+{
+  LqrRetVal ret;
 
-  CATCH (lqr_carver_rigmask_add_rgb_area
-         (r, rgb, bpp, w, h, x_off, y_off));
+  carver_setup_release (setup, NULL);
+
+#if GLIB_CHECK_VERSION (2, 36, 0)
+  if (setup->pool != NULL)
+    {
+      g_thread_pool_free (setup->pool, FALSE, TRUE);
+    }
+#endif /* GLIB_CHECK_VERSION (2, 36, 0) */
 
-  g_free(rgb);
+  ret = (setup->read_ret != LQR_OK) ? setup->read_ret : setup->ret;
+  g_free (setup);
 
-  return LQR_OK;
+  return ret;
 }
 
-
 LqrRetVal
 write_carver_to_layer (LqrCarver * r, gint32 layer_ID)
 {
-  GimpDrawable * drawable;
-  gint y;
-  gint w, h;
-  GimpPixelRgn rgn_out;
+  return write_carver_rect (r, layer_ID, 0, 0, gimp_drawable_width (layer_ID),
+                            gimp_drawable_height (layer_ID), FALSE);
+}
+
+/* Writes the carver, at its current size, to the part of the layer
+ * which starts at (x0, y0). The pixels go straight to the layer, so
+ * that the rest of it, written by earlier calls, is kept; this is
+ * undone along with the last resize of the layer */
+LqrRetVal
+write_carver_to_layer_area (LqrCarver * r, gint32 layer_ID, gint x0, gint y0)
+{
+  return write_carver_rect (r, layer_ID, x0, y0, lqr_carver_get_width (r),
+                            lqr_carver_get_height (r), TRUE);
+}
+
+/* Writes a buffer, as read by native_buffer_from_layer_area, back to
+ * an area of a layer; as above, the pixels go straight to the layer */
+void
+write_buffer_to_layer_area (gpointer buffer, LqrColDepth col_depth,
+                            gint32 layer_ID, gint x0, gint y0, gint w, gint h)
+{
+  LayerSink sink;
+
+  layer_sink_open (&sink, layer_ID, col_depth, TRUE);
+  layer_sink_set_rect (&sink, buffer, x0, y0, w, h);
+  layer_sink_close (&sink);
+}
+
+static LqrRetVal
+write_carver_rect (LqrCarver * r, gint32 layer_ID, gint x0, gint y0,
+                   gint w, gint h, gboolean direct)
+{
+  gint y, i;
+  gint bpp;
+  gint n_lines;
+  gboolean by_row;
+  LayerSink sink;
   guchar *out_line;
+  guchar *block = NULL;
+  guchar *dest;
+  gint tile_w, block_x0, block_w;
   gint update_step;
 
-  gimp_progress_init (_("Applying changes..."));
-  update_step = MAX ((lqr_carver_get_height(r) - 1) / 20, 1);
+  /* bytes per pixel in the carver's own colour depth */
+  bpp = lqr_carver_get_channels (r) * col_depth_size (lqr_carver_get_col_depth (r));
 
-  drawable = gimp_drawable_get (layer_ID);
+  by_row = lqr_carver_scan_by_row (r);
+  n_lines = by_row ? h : w;
 
-  w = gimp_drawable_width (layer_ID);
-  h = gimp_drawable_height (layer_ID);
+  /* when scanning by columns, the columns are transposed into a
+   * block as wide as a tile, which is then committed at once, so
+   * that each tile is written only once */
+  tile_w = gimp_tile_width ();
+  if (!by_row)
+    {
+      CATCH_MEM (block = g_try_new (guchar, tile_w * h * bpp));
+    }
+  block_x0 = 0;
+  block_w = 0;
 
-  gimp_pixel_rgn_init (&rgn_out, drawable, 0, 0, w, h, TRUE, TRUE);
+  progress_task_start (_("Applying changes..."));
+  update_step = MAX ((n_lines - 1) / 20, 1);
 
+  layer_sink_open (&sink, layer_ID, lqr_carver_get_col_depth (r), direct);
 
-  while (lqr_carver_scan_line (r, &y, &out_line))
+  while (lqr_carver_scan_line_ext (r, &y, (void **) &out_line))
     {
-      if (lqr_carver_scan_by_row(r))
+      if (by_row)
         {
-          gimp_pixel_rgn_set_row (&rgn_out, out_line, 0, y, w);
+          layer_sink_set_rect (&sink, out_line, x0, y0 + y, w, 1);
         }
       else
         {
-          gimp_pixel_rgn_set_col (&rgn_out, out_line, y, 0, h);
+          /* lines are scanned in order, so leaving the current
+           * block means that it is complete */
+          if ((y < block_x0) || (y >= block_x0 + block_w))
+            {
+              if (block_w > 0)
+                {
+                  layer_sink_set_rect (&sink, block, x0 + block_x0, y0, block_w, h);
+                }
+              block_x0 = y - y % tile_w;
+              block_w = MIN (tile_w, w - block_x0);
+            }
+
+          dest = block + (y - block_x0) * bpp;
+          for (i = 0; i < h; i++)
+            {
+              memcpy (dest, out_line + i * bpp, bpp);
+              dest += block_w * bpp;
+            }
         }
 
       if (y % update_step == 0)
         {
-          gimp_progress_update ((gdouble) y / (lqr_carver_get_height(r) - 1));
+          progress_task_update ((gdouble) y / (n_lines - 1));
         }
 
     }
 
-  gimp_drawable_flush (drawable);
-  gimp_drawable_merge_shadow (layer_ID, TRUE);
-  gimp_drawable_update (layer_ID, 0, 0, w, h);
+  if (block_w > 0)
+    {
+      layer_sink_set_rect (&sink, block, x0 + block_x0, y0, block_w, h);
+    }
 
-  gimp_drawable_detach (drawable);
+  g_free (block);
+
+  layer_sink_close (&sink);
 
-  gimp_progress_end();
+  progress_task_end ();
 
   return LQR_OK;
 }
 
+/* Encodes the carver straight to a PAM file, bypassing the layer,
+ * in the same format as the layer it was read from */
 LqrRetVal
-write_vmap_to_layer (LqrVMap * vmap, gpointer data)
+write_carver_to_file (LqrCarver * r, gint32 layer_ID, const gchar * filename)
 {
+  gint y, i;
   gint w, h, bpp;
-  gint depth;
-  gint *buffer;
-  gint32 seam_layer_ID;
-  gint32 * seam_layer_p;
-  gint32 image_ID;
-  GimpDrawable *drawable;
-  gint x_off, y_off;
-  gchar *name;
-  GimpRGB col_start, col_end;
-  GimpPixelRgn rgn_out;
-  guchar *outrow;
-  gdouble value, rd, gr, bl, al;
-  gint vs, y, x, k;
+  gint n_lines;
+  gboolean by_row;
+  gboolean ok = TRUE;
+  FileSink sink;
+  guchar *out_line;
+  guchar *image = NULL;
   gint update_step;
+  LqrRetVal ret;
 
-  image_ID = VMAP_FUNC_ARG (data)->image_ID;
-  x_off = VMAP_FUNC_ARG (data)->x_off;
-  y_off = VMAP_FUNC_ARG (data)->y_off;
-  name = VMAP_FUNC_ARG (data)->name;
-  col_start = VMAP_FUNC_ARG (data)->colour_start;
-  col_end = VMAP_FUNC_ARG (data)->colour_end;
-  seam_layer_ID = -1;
-  seam_layer_p = VMAP_FUNC_ARG (data)->vmap_layer_ID_p;
-  if (seam_layer_p)
-    {
-      seam_layer_ID = *seam_layer_p;
-    }
-
-  w = lqr_vmap_get_width(vmap);
-  h = lqr_vmap_get_height(vmap);
-  buffer = lqr_vmap_get_data(vmap);
-  depth = lqr_vmap_get_depth(vmap);
+  w = lqr_carver_get_width (r);
+  h = lqr_carver_get_height (r);
+  bpp = lqr_carver_get_channels (r) * col_depth_size (lqr_carver_get_col_depth (r));
 
-  gimp_progress_init (_("Drawing seam map..."));
-  update_step = MAX ((h - 1) / 20, 1);
+  by_row = lqr_carver_scan_by_row (r);
+  n_lines = by_row ? h : w;
 
-  if (!gimp_drawable_is_valid (seam_layer_ID))
+  /* the file is written in row order; when the carver is scanned by
+   * columns, these are gathered first */
+  if (!by_row)
     {
-      seam_layer_ID =
-        gimp_layer_new (image_ID, name, w, h, GIMP_RGBA_IMAGE, 100,
-                        GIMP_NORMAL_MODE);
-      gimp_drawable_fill (seam_layer_ID, GIMP_TRANSPARENT_FILL);
-      gimp_image_insert_layer (image_ID, seam_layer_ID, 0, -1);
-      gimp_layer_translate (seam_layer_ID, x_off, y_off);
-      if (seam_layer_p)
-        {
-          *seam_layer_p = seam_layer_ID;
-        }
+      CATCH_MEM (image = g_try_new (guchar, (gsize) w * h * bpp));
     }
-  else
+
+  ret = file_sink_open (&sink, filename, layer_ID, w, h,
+                        lqr_carver_get_channels (r), lqr_carver_get_col_depth (r));
+  if (ret != LQR_OK)
     {
-      gimp_layer_resize  (seam_layer_ID, w, h, 0, 0);
+      g_free (image);
+      return ret;
     }
-  drawable = gimp_drawable_get (seam_layer_ID);
 
-  bpp = 4;
+  progress_task_start (_("Writing file..."));
+  update_step = MAX ((n_lines - 1) / 20, 1);
 
-  gimp_pixel_rgn_init (&rgn_out, drawable, 0, 0, w, h, TRUE, TRUE);
-
-  CATCH_MEM (outrow = g_try_new (guchar, w * bpp));
-
-  for (y = 0; y < h; y++)
+  while (lqr_carver_scan_line_ext (r, &y, (void **) &out_line))
     {
-      for (x = 0; x < w; x++)
+      if (by_row)
         {
-          vs = buffer[y * w + x];
-          if (vs == 0)
-            {
-              for (k = 0; k < bpp; k++)
-                {
-                  outrow[x * bpp + k] = 0;
-                }
-            }
-          else
+          ok = ok && file_sink_write_row (&sink, out_line);
+        }
+      else
+        {
+          for (i = 0; i < h; i++)
             {
-              value = (double) (depth + 1 - vs) / (depth + 1);
-              rd = value * col_start.r + (1 - value) * col_end.r;
-              gr = value * col_start.g + (1 - value) * col_end.g;
-              bl = value * col_start.b + (1 - value) * col_end.b;
-              al = 0.5 * (1 + value);
-              outrow[x * bpp] = 255 * rd;
-              outrow[x * bpp + 1] = 255 * gr;
-              outrow[x * bpp + 2] = 255 * bl;
-              outrow[x * bpp + 3] = 255 * al;
+              memcpy (image + ((gsize) i * w + y) * bpp, out_line + i * bpp, bpp);
             }
         }
-      gimp_pixel_rgn_set_row (&rgn_out, outrow, 0, y, w);
+
       if (y % update_step == 0)
         {
-          gimp_progress_update ((gdouble) y / (h - 1));
+          progress_task_update ((gdouble) y / (n_lines - 1));
         }
     }
 
-  gimp_drawable_flush (drawable);
-  gimp_drawable_merge_shadow (seam_layer_ID, TRUE);
-  gimp_drawable_update (seam_layer_ID, 0, 0, w, h);
-  gimp_drawable_set_visible (seam_layer_ID, TRUE);
-  gimp_drawable_detach (drawable);
+  for (i = 0; (image != NULL) && (i < h); i++)
+    {
+      ok = ok && file_sink_write_row (&sink, image + (gsize) i * w * bpp);
+    }
 
-  gimp_progress_end();
+  g_free (image);
 
-  return LQR_OK;
+  progress_task_end ();
+
+  ret = file_sink_close (&sink);
+
+  return ok ? ret : LQR_ERROR;
 }
 
 LqrRetVal
-write_all_vmaps (LqrVMapList * list, gint32 image_ID, gchar * orig_name,
-                 gint x_off, gint y_off, GimpRGB col_start, GimpRGB col_end)
+write_vmap_to_layer (LqrVMap * vmap, gpointer data)
 {
-  gchar name[LQR_MAX_NAME_LENGTH];
-  VMapFuncArg data;
+  guint32 *pixels;
+  gint32 seam_layer_ID;
 
-  /* The name of the layer with the seams map */
-  /* (here "%s" represents the selected layer's name) */
-  g_snprintf (name, LQR_MAX_NAME_LENGTH, _("%s seam map"), orig_name);
+  progress_task_start (_("Drawing seam map..."));
 
+  CATCH_MEM (pixels = vmap_rasterize (vmap, VMAP_FUNC_ARG (data)->colour_start,
+                                      VMAP_FUNC_ARG (data)->colour_end));
 
-  data.image_ID = image_ID;
-  data.name = name;
-  data.x_off = x_off;
-  data.y_off = y_off;
-  data.colour_start = col_start;
-  data.colour_end = col_end;
+  seam_layer_ID = vmap_layer_prepare (VMAP_FUNC_ARG (data),
+                                      lqr_vmap_get_width (vmap),
+                                      lqr_vmap_get_height (vmap));
+  vmap_layer_upload (seam_layer_ID, pixels, lqr_vmap_get_width (vmap),
+                     lqr_vmap_get_height (vmap));
+
+  g_free (pixels);
+
+  progress_task_end ();
+
+  return LQR_OK;
+}
+
+#if GLIB_CHECK_VERSION (2, 36, 0)
+
+/* A seam map to be rasterized by the worker pool; pixels is
+ * set, and done raised, under the lock of the queue */
+
+typedef struct
+{
+  LqrVMap *vmap;
+  guint32 *pixels;
+  gboolean done;
+} VMapJob;
+
+typedef struct
+{
+  GMutex lock;
+  GCond cond;
+  GimpRGB colour_start;
+  GimpRGB colour_end;
+} VMapJobQueue;
+
+static void
+vmap_job_run (gpointer job_p, gpointer queue_p)
+{
+  VMapJob *job = job_p;
+  VMapJobQueue *queue = queue_p;
+  guint32 *pixels;
+
+  /* only plain computation here: the calls to GIMP
+   * must all come from the main thread */
+  pixels = vmap_rasterize (job->vmap, queue->colour_start, queue->colour_end);
+
+  g_mutex_lock (&queue->lock);
+  job->pixels = pixels;
+  job->done = TRUE;
+  g_cond_broadcast (&queue->cond);
+  g_mutex_unlock (&queue->lock);
+}
+
+#endif /* GLIB_CHECK_VERSION (2, 36, 0) */
+
+LqrRetVal
+write_all_vmaps (LqrVMapList * list, gint32 image_ID, gchar * orig_name,
+                 gint x_off, gint y_off, GimpRGB col_start, GimpRGB col_end)
+{
+  gchar name[LQR_MAX_NAME_LENGTH];
+  VMapFuncArg data;
+#if GLIB_CHECK_VERSION (2, 36, 0)
+  LqrVMapList *l;
+  VMapJob *jobs;
+  VMapJobQueue queue;
+  GThreadPool *pool;
+  gint32 seam_layer_ID;
+  gint n, i;
+  LqrRetVal ret = LQR_OK;
+#endif /* GLIB_CHECK_VERSION (2, 36, 0) */
+
+  /* The name of the layer with the seams map */
+  /* (here "%s" represents the selected layer's name) */
+  g_snprintf (name, LQR_MAX_NAME_LENGTH, _("%s seam map"), orig_name);
+
+
+  data.image_ID = image_ID;
+  data.name = name;
+  data.x_off = x_off;
+  data.y_off = y_off;
+  data.colour_start = col_start;
+  data.colour_end = col_end;
   data.vmap_layer_ID_p = NULL;
 
+#if GLIB_CHECK_VERSION (2, 36, 0)
+  n = 0;
+  for (l = list; l != NULL; l = lqr_vmap_list_next (l))
+    {
+      n++;
+    }
+  if (n < 2)
+    {
+      return lqr_vmap_list_foreach (list, write_vmap_to_layer,
+                                    (gpointer) (&data));
+    }
+
+  /* all the maps are rasterized concurrently, while the main
+   * thread uploads them to GIMP, in order, as they get ready */
+  CATCH_MEM (jobs = g_try_new0 (VMapJob, n));
+  for (l = list, i = 0; l != NULL; l = lqr_vmap_list_next (l), i++)
+    {
+      jobs[i].vmap = lqr_vmap_list_current (l);
+    }
+
+  g_mutex_init (&queue.lock);
+  g_cond_init (&queue.cond);
+  queue.colour_start = col_start;
+  queue.colour_end = col_end;
+
+  pool = g_thread_pool_new (vmap_job_run, &queue,
+                            MIN (n, (gint) g_get_num_processors ()), FALSE, NULL);
+  for (i = 0; i < n; i++)
+    {
+      g_thread_pool_push (pool, &jobs[i], NULL);
+    }
+
+  for (i = 0; i < n; i++)
+    {
+      g_mutex_lock (&queue.lock);
+      while (!jobs[i].done)
+        {
+          g_cond_wait (&queue.cond, &queue.lock);
+        }
+      g_mutex_unlock (&queue.lock);
+
+      if (jobs[i].pixels == NULL)
+        {
+          ret = LQR_NOMEM;
+          break;
+        }
+
+      progress_task_start (_("Drawing seam map..."));
+      seam_layer_ID = vmap_layer_prepare (&data, lqr_vmap_get_width (jobs[i].vmap),
+                                          lqr_vmap_get_height (jobs[i].vmap));
+      vmap_layer_upload (seam_layer_ID, jobs[i].pixels,
+                         lqr_vmap_get_width (jobs[i].vmap),
+                         lqr_vmap_get_height (jobs[i].vmap));
+      progress_task_end ();
+
+      g_free (jobs[i].pixels);
+      jobs[i].pixels = NULL;
+    }
+
+  /* waits for the workers which may still be running */
+  g_thread_pool_free (pool, FALSE, TRUE);
+
+  for (i = 0; i < n; i++)
+    {
+      g_free (jobs[i].pixels);
+    }
+  g_free (jobs);
+  g_cond_clear (&queue.cond);
+  g_mutex_clear (&queue.lock);
+
+  return ret;
+#else
   return lqr_vmap_list_foreach (list, write_vmap_to_layer,
                                 (gpointer) (&data));
+#endif /* GLIB_CHECK_VERSION (2, 36, 0) */
+}
+
+/* Writes the seam maps as raw depth values, i.e. for each pixel the
+ * number of the seam which removed it (0 if none), in the grayscale
+ * layers of a new image. With high_depth the image has 16 bit
+ * integer precision; otherwise the values are clamped to 255 */
+LqrRetVal
+write_all_depth_maps (LqrVMapList * list, gchar * orig_name, gboolean high_depth)
+{
+  gchar name[LQR_MAX_NAME_LENGTH];
+  LqrVMapList *l;
+  LqrVMap *vmap;
+  gint32 image_ID;
+  gint w, h;
+  LqrRetVal ret = LQR_OK;
+
+  if (list == NULL)
+    {
+      return LQR_OK;
+    }
+
+#ifndef HAVE_GIMP_2_10
+  /* no high precision images */
+  high_depth = FALSE;
+#endif /* HAVE_GIMP_2_10 */
+
+  /* The name of the layer with the seams map */
+  /* (here "%s" represents the selected layer's name) */
+  g_snprintf (name, LQR_MAX_NAME_LENGTH, _("%s seam map"), orig_name);
+
+  w = 0;
+  h = 0;
+  for (l = list; l != NULL; l = lqr_vmap_list_next (l))
+    {
+      w = MAX (w, lqr_vmap_get_width (lqr_vmap_list_current (l)));
+      h = MAX (h, lqr_vmap_get_height (lqr_vmap_list_current (l)));
+    }
+
+#ifdef HAVE_GIMP_2_10
+  if (high_depth)
+    {
+      image_ID = gimp_image_new_with_precision (w, h, GIMP_GRAY,
+                                                GIMP_PRECISION_U16_LINEAR);
+    }
+  else
+#endif /* HAVE_GIMP_2_10 */
+    {
+      image_ID = gimp_image_new (w, h, GIMP_GRAY);
+    }
+  gimp_image_undo_disable (image_ID);
+
+  for (l = list; (l != NULL) && (ret == LQR_OK); l = lqr_vmap_list_next (l))
+    {
+      vmap = lqr_vmap_list_current (l);
+      ret = write_depth_map (vmap, image_ID, name, high_depth);
+    }
+
+  gimp_image_undo_enable (image_ID);
+  gimp_display_new (image_ID);
+
+  return ret;
+}
+
+/* Returns the number of seams of the deepest map in the list */
+gint
+vmap_list_max_depth (LqrVMapList * list)
+{
+  gint depth = 0;
+
+  for (; list != NULL; list = lqr_vmap_list_next (list))
+    {
+      depth = MAX (depth, lqr_vmap_get_depth (lqr_vmap_list_current (list)));
+    }
+
+  return depth;
+}
+
+/* Reads back a seam map layer, either a depth map or a colour map
+ * as written by the seams output, into a new visibility map. Each
+ * seam crosses every line of the map once, so the seam levels
+ * along a line are the ranks of its carved pixels, sorted by depth
+ * (by decreasing opacity in colour maps); any monotonic rescaling
+ * of the values, e.g. to another precision, is thus harmless.
+ * Returns LQR_ERROR if the layer does not hold a seam map */
+LqrRetVal
+vmap_from_layer (gint32 layer_ID, LqrVMap ** vmap)
+{
+  gint w, h, channels;
+  gint orientation;
+  gint depth;
+  gint max_value;
+  gsize i, size;
+  gint *data;
+  VMapRank *ranks;
+  gboolean ok;
+#ifdef HAVE_GIMP_2_10
+  guint16 *buffer;
+#else
+  guchar *buffer;
+#endif /* HAVE_GIMP_2_10 */
+
+  w = gimp_drawable_width (layer_ID);
+  h = gimp_drawable_height (layer_ID);
+  channels = layer_channels (layer_ID);
+  size = (gsize) w * h;
+
+#ifdef HAVE_GIMP_2_10
+  /* 16 bit depth maps are read without loss */
+  CATCH_MEM (buffer = g_try_new (guint16, size * channels));
+  progress_task_start (_("Parsing layer..."));
+  layer_read_area (layer_ID, 0, 0, w, h, LQR_COLDEPTH_16I, buffer);
+  progress_task_end ();
+  max_value = G_MAXUINT16;
+#else
+  CATCH_MEM (buffer = rgb_buffer_from_layer (layer_ID));
+  max_value = G_MAXUINT8;
+#endif /* HAVE_GIMP_2_10 */
+
+  data = g_try_new (gint, size);
+  if (data == NULL)
+    {
+      g_free (buffer);
+      return LQR_NOMEM;
+    }
+
+  /* uncarved pixels are 0 in depth maps, and transparent
+   * in colour maps */
+  for (i = 0; i < size; i++)
+    {
+      if ((channels == 2) || (channels == 4))
+        {
+          data[i] = buffer[i * channels + channels - 1];
+          data[i] = data[i] ? max_value + 1 - data[i] : 0;
+        }
+      else
+        {
+          data[i] = buffer[i * channels];
+        }
+    }
+  g_free (buffer);
+
+  orientation = 0;
+  depth = vmap_lines_depth (data, w, h, 0);
+  if (depth <= 0)
+    {
+      orientation = 1;
+      depth = vmap_lines_depth (data, w, h, 1);
+    }
+  if (depth <= 0)
+    {
+      g_free (data);
+      return LQR_ERROR;
+    }
+
+  ranks = g_try_new (VMapRank, depth);
+  if (ranks == NULL)
+    {
+      g_free (data);
+      return LQR_NOMEM;
+    }
+  ok = vmap_lines_rank (data, w, h, orientation, depth, ranks);
+  g_free (ranks);
+  if (!ok)
+    {
+      g_free (data);
+      return LQR_ERROR;
+    }
+
+  *vmap = lqr_vmap_new (data, w, h, depth, orientation);
+  if (*vmap == NULL)
+    {
+      g_free (data);
+      return LQR_NOMEM;
+    }
+
+  return LQR_OK;
+}
+
+/* Projects a visibility map, found on a copy of the carver's pixels
+ * scaled down, to their full size, with exactly depth seams. Each
+ * coarse seam gives about as many seams at full size as the scale
+ * factor, which are traced one after the other, as the seams of the
+ * lowest energy (by dynamic programming) through the band of the
+ * coarse seam, widened by the factor on either side; like those of
+ * liblqr, they move by at most delta_x pixels from a line to the
+ * next, counted in the line as carved so far */
+LqrRetVal
+vmap_project (LqrVMap * coarse, gconstpointer pixels, gint width,
+              gint height, gint channels, LqrColDepth col_depth,
+              gint depth, gint delta_x, LqrVMap ** vmap)
+{
+  VMapTrace t;
+  gint cw, ch, coarse_depth;
+  gint coarse_lines, coarse_len;
+  gint line, k, level, s;
+  gint margin;
+  const gint *cdata;
+  gint *coarse_pos;
+  gsize i;
+  LqrRetVal ret = LQR_OK;
+
+  cw = lqr_vmap_get_width (coarse);
+  ch = lqr_vmap_get_height (coarse);
+  coarse_depth = lqr_vmap_get_depth (coarse);
+  cdata = lqr_vmap_get_data (coarse);
+
+  memset (&t, 0, sizeof (VMapTrace));
+  t.pixels = pixels;
+  t.width = width;
+  t.height = height;
+  t.channels = channels;
+  /* the alpha channel (if any) is left out of the energy */
+  t.n_colours = (channels < 3) ? 1 : 3;
+  t.col_depth = col_depth;
+  t.orientation = lqr_vmap_get_orientation (coarse);
+  t.lines = t.orientation ? width : height;
+  t.len = t.orientation ? height : width;
+  t.delta_x = delta_x;
+
+  coarse_lines = t.orientation ? cw : ch;
+  coarse_len = t.orientation ? ch : cw;
+  if ((depth <= 0) || (depth >= t.len) || (coarse_depth <= 0))
+    {
+      return LQR_ERROR;
+    }
+
+  /* where each coarse seam crosses each coarse line */
+  CATCH_MEM (coarse_pos = g_try_new (gint, (gsize) coarse_depth * coarse_lines));
+  for (i = 0; i < (gsize) coarse_depth * coarse_lines; i++)
+    {
+      coarse_pos[i] = -1;
+    }
+  for (line = 0; line < coarse_lines; line++)
+    {
+      for (k = 0; k < coarse_len; k++)
+        {
+          level = t.orientation ? cdata[(gsize) k * cw + line] :
+            cdata[(gsize) line * cw + k];
+          if ((level > 0) && (level <= coarse_depth))
+            {
+              coarse_pos[(gsize) (level - 1) * coarse_lines + line] = k;
+            }
+        }
+    }
+  for (i = 0; i < (gsize) coarse_depth * coarse_lines; i++)
+    {
+      if (coarse_pos[i] < 0)
+        {
+          g_free (coarse_pos);
+          return LQR_ERROR;
+        }
+    }
+
+  t.data = g_try_new0 (gint, (gsize) width * height);
+  t.carved = g_try_new0 (gint, (gsize) width * height);
+  t.start = g_try_new (gint, t.lines + 1);
+  margin = (t.len + coarse_len - 1) / coarse_len;
+  if ((t.data == NULL) || (t.carved == NULL) || (t.start == NULL) ||
+      !vmap_trace_reserve (&t, (gsize) t.lines * 4 * margin))
+    {
+      ret = LQR_NOMEM;
+    }
+
+  /* the seams are shared out evenly among the coarse ones, in
+   * their order */
+  for (s = 0; (s < depth) && (ret == LQR_OK); s++)
+    {
+      level = (gint) ((gint64) s * coarse_depth / depth);
+      ret = vmap_trace_seam (&t, coarse_pos + (gsize) level * coarse_lines,
+                             coarse_lines, coarse_len, margin, s + 1);
+    }
+
+  g_free (coarse_pos);
+  g_free (t.carved);
+  g_free (t.start);
+  g_free (t.pos);
+  g_free (t.cur);
+  g_free (t.cost);
+  g_free (t.from);
+
+  if (ret != LQR_OK)
+    {
+      g_free (t.data);
+      return ret;
+    }
+
+  *vmap = lqr_vmap_new (t.data, width, height, depth, t.orientation);
+  if (*vmap == NULL)
+    {
+      g_free (t.data);
+      return LQR_NOMEM;
+    }
+
+  return LQR_OK;
+}
+
+/* Computes the part of a mask layer which overlaps the carver.
+ * On output, (x, y, w, h) is the area to be read in layer coordinates,
+ * and (x_off, y_off) is its position relative to the carver.
+ * Returns FALSE if there is no overlap at all. */
+static gboolean
+mask_area_clip (gint width, gint height, gint32 layer_ID,
+                gint base_x_off, gint base_y_off,
+                gint * x, gint * y, gint * w, gint * h,
+                gint * x_off, gint * y_off)
+{
+  gint layer_x_off, layer_y_off;
+  gint x1, y1, x2, y2;
+
+  gimp_drawable_offsets (layer_ID, &layer_x_off, &layer_y_off);
+  layer_x_off -= base_x_off;
+  layer_y_off -= base_y_off;
+
+  x1 = MAX (0, -layer_x_off);
+  y1 = MAX (0, -layer_y_off);
+  x2 = MIN (gimp_drawable_width (layer_ID), width - layer_x_off);
+  y2 = MIN (gimp_drawable_height (layer_ID), height - layer_y_off);
+
+  if ((x2 <= x1) || (y2 <= y1))
+    {
+      return FALSE;
+    }
+
+  *x = x1;
+  *y = y1;
+  *w = x2 - x1;
+  *h = y2 - y1;
+  *x_off = layer_x_off + x1;
+  *y_off = layer_y_off + y1;
+
+  return TRUE;
+}
+
+static gint
+count_tiles (gint x0, gint y0, gint w, gint h)
+{
+  gint tile_w = gimp_tile_width ();
+  gint tile_h = gimp_tile_height ();
+
+  return ((x0 + w - 1) / tile_w - x0 / tile_w + 1) *
+    ((y0 + h - 1) / tile_h - y0 / tile_h + 1);
+}
+
+/* Adds to a row of the bias plane coeff times a row of mask
+ * intensities, scaled to [0, 1] */
+static void
+bias_row_add (gdouble * dest, const guchar * src, gint w, gint coeff)
+{
+  gint x;
+  gdouble scale;
+
+  scale = (gdouble) coeff / 255;
+
+  for (x = 0; x < w; x++)
+    {
+      dest[x] += scale * src[x];
+    }
+}
+
+/* Converts a row of mask pixels to intensities, i.e. the mean of their
+ * colour channels, weighted by their alpha, rounded to a byte */
+static void
+mask_row_quantize (guchar * dest, const guchar * src, gint w, gint bpp)
+{
+  gint x, k;
+  gint sum;
+  gint c_channels;
+  gboolean has_alpha;
+
+  has_alpha = ((bpp == 2) || (bpp == 4));
+  c_channels = bpp - (has_alpha ? 1 : 0);
+
+  for (x = 0; x < w; x++, src += bpp)
+    {
+      sum = 0;
+      for (k = 0; k < c_channels; k++)
+        {
+          sum += src[k];
+        }
+      if (has_alpha)
+        {
+          dest[x] = (sum * src[bpp - 1] + c_channels * 255 / 2) /
+            (c_channels * 255);
+        }
+      else
+        {
+          dest[x] = (sum + c_channels / 2) / c_channels;
+        }
+    }
+}
+
+/* Returns row y of a tile's intensities; buf (at least tile->w bytes)
+ * is used to expand the bitset tiles */
+static const guchar *
+mask_tile_row (const MaskTile * tile, gint y, guchar * buf)
+{
+  gint x, i;
+
+  if (tile->data != NULL)
+    {
+      return tile->data + y * tile->w;
+    }
+
+  for (x = 0, i = y * tile->w; x < tile->w; x++, i++)
+    {
+      buf[x] = tile->value[(tile->bits[i >> 3] >> (i & 7)) & 1];
+    }
+  return buf;
+}
+
+static MaskTileList *
+mask_tiles_new (gint bpp, gint max_tiles)
+{
+  MaskTileList *mask;
+
+  LQR_TRY_N_N (mask = g_try_new (MaskTileList, 1));
+  mask->bpp = bpp;
+  mask->n = 0;
+  mask->tiles = g_try_new (MaskTile, max_tiles);
+  if (mask->tiles == NULL)
+    {
+      g_free (mask);
+      return NULL;
+    }
+  return mask;
+}
+
+/* Stores the intensities of the given tile, unless they are all zero;
+ * src is in the layer format. Returns FALSE if out of memory */
+static gboolean
+mask_tiles_add (MaskTileList * mask, const guchar * src, gint rowstride,
+                gint x, gint y, gint w, gint h)
+{
+  gint i, n;
+  gint v0, v1;
+  MaskTile *tile;
+  guchar *data;
+  guchar *bits;
+
+  n = w * h;
+  data = g_try_new (guchar, n);
+  if (data == NULL)
+    {
+      return FALSE;
+    }
+  for (i = 0; i < h; i++)
+    {
+      mask_row_quantize (data + i * w, src + i * rowstride, w, mask->bpp);
+    }
+
+  /* look for (at most) two distinct values */
+  v0 = data[0];
+  v1 = -1;
+  for (i = 0; i < n; i++)
+    {
+      if (data[i] == v0 || data[i] == v1)
+        {
+          continue;
+        }
+      if (v1 >= 0)
+        {
+          break;
+        }
+      v1 = data[i];
+    }
+
+  if ((v0 == 0) && (v1 < 0))
+    {
+      g_free (data);
+      return TRUE;
+    }
+
+  tile = &mask->tiles[mask->n];
+  tile->x = x;
+  tile->y = y;
+  tile->w = w;
+  tile->h = h;
+  tile->data = data;
+  tile->bits = NULL;
+  mask->n++;
+
+  if (i < n)
+    {
+      return TRUE;
+    }
+
+  /* two-level tiles (e.g. hand-painted masks) are kept as a bitset;
+   * if that can't be allocated the bytes are kept instead */
+  bits = g_try_new0 (guchar, (n + 7) / 8);
+  if (bits == NULL)
+    {
+      return TRUE;
+    }
+  tile->value[0] = v0;
+  tile->value[1] = (v1 < 0) ? v0 : v1;
+  for (i = 0; i < n; i++)
+    {
+      if (data[i] != v0)
+        {
+          bits[i >> 3] |= 1 << (i & 7);
+        }
+    }
+  g_free (data);
+  tile->data = NULL;
+  tile->bits = bits;
+  return TRUE;
+}
+
+/* Splits a row of tiles, w pixels wide from the layer column x0, at
+ * the tile boundaries of the layer and stores each piece with
+ * mask_tiles_add; y is the offset of the row relative to the area
+ * which is read */
+static gboolean
+mask_tiles_add_row (MaskTileList * mask, const guchar * src, gint rowstride,
+                    gint x0, gint y, gint w, gint h)
+{
+  gint x, tw;
+  gint tile_w = gimp_tile_width ();
+
+  for (x = x0; x < x0 + w; x += tw)
+    {
+      tw = MIN (tile_w - x % tile_w, x0 + w - x);
+      if (!mask_tiles_add (mask, src + (x - x0) * mask->bpp,
+                           rowstride, x - x0, y, tw, h))
+        {
+          return FALSE;
+        }
+    }
+  return TRUE;
+}
+
+/* Reads the non-empty tiles of a mask layer, taking them from the
+ * cache (and filling it) if one is given */
+static MaskTileList *
+mask_tiles_read (gint32 layer_ID, gint x0, gint y0, gint w, gint h,
+                 GHashTable * cache)
+{
+  guchar *buffer;
+
+  if (cache == NULL)
+    {
+      return mask_tiles_from_layer_area (layer_ID, x0, y0, w, h);
+    }
+
+  LQR_TRY_N_N (buffer = layer_cache_get (cache, layer_ID));
+  return mask_tiles_from_buffer (buffer, gimp_drawable_width (layer_ID),
+                                 layer_channels (layer_ID), x0, y0, w, h);
+}
+
+/* Prepares a layer for being written, through its shadow. The data
+ * passed to layer_sink_set_rect must be in the given colour depth */
+static void
+layer_sink_open (LayerSink * sink, gint32 layer_ID, LqrColDepth col_depth,
+                 gboolean direct)
+{
+  sink->layer_ID = layer_ID;
+  sink->w = gimp_drawable_width (layer_ID);
+  sink->h = gimp_drawable_height (layer_ID);
+  sink->direct = direct;
+#ifdef HAVE_GIMP_2_10
+  sink->buffer = direct ? gimp_drawable_get_buffer (layer_ID) :
+    gimp_drawable_get_shadow_buffer (layer_ID);
+  sink->format = layer_format (layer_ID, col_depth);
+#else
+  sink->drawable = gimp_drawable_get (layer_ID);
+  gimp_pixel_rgn_init (&sink->rgn, sink->drawable, 0, 0, sink->w, sink->h,
+                       TRUE, !direct);
+#endif /* HAVE_GIMP_2_10 */
+}
+
+static void
+layer_sink_set_rect (LayerSink * sink, guchar * data,
+                     gint x, gint y, gint w, gint h)
+{
+#ifdef HAVE_GIMP_2_10
+  gegl_buffer_set (sink->buffer, GEGL_RECTANGLE (x, y, w, h), 0,
+                   sink->format, data, GEGL_AUTO_ROWSTRIDE);
+#else
+  gimp_pixel_rgn_set_rect (&sink->rgn, data, x, y, w, h);
+#endif /* HAVE_GIMP_2_10 */
+}
+
+/* Commits the shadow (if any) and updates the layer */
+static void
+layer_sink_close (LayerSink * sink)
+{
+#ifdef HAVE_GIMP_2_10
+  g_object_unref (sink->buffer);
+#else
+  gimp_drawable_flush (sink->drawable);
+#endif /* HAVE_GIMP_2_10 */
+  if (!sink->direct)
+    {
+      gimp_drawable_merge_shadow (sink->layer_ID, TRUE);
+    }
+  gimp_drawable_update (sink->layer_ID, 0, 0, sink->w, sink->h);
+#ifndef HAVE_GIMP_2_10
+  gimp_drawable_detach (sink->drawable);
+#endif /* HAVE_GIMP_2_10 */
+}
+
+/* Creates the file and writes the PAM header. 8 bit layers are
+ * written as they are; deeper ones are converted to 16 bit samples
+ * in the perceptual space, as netpbm files have no gamma tag */
+static LqrRetVal
+file_sink_open (FileSink * sink, const gchar * filename, gint32 layer_ID,
+                gint w, gint h, gint channels, LqrColDepth col_depth)
+{
+  static const gchar *tupltype[] =
+    { "GRAYSCALE", "GRAYSCALE_ALPHA", "RGB", "RGB_ALPHA" };
+#ifdef HAVE_GIMP_2_10
+  static const gchar *model[] = { "Y'", "Y'A", "R'G'B'", "R'G'B'A" };
+  gchar name[LQR_MAX_NAME_LENGTH];
+#endif /* HAVE_GIMP_2_10 */
+
+  sink->w = w;
+  sink->channels = channels;
+  sink->sample_size = (col_depth == LQR_COLDEPTH_8I) ? 1 : 2;
+  sink->row = NULL;
+
+#ifdef HAVE_GIMP_2_10
+  g_snprintf (name, LQR_MAX_NAME_LENGTH, "%s %s", model[channels - 1],
+              (sink->sample_size == 1) ? "u8" : "u16");
+  sink->fish = babl_fish (layer_format (layer_ID, col_depth), babl_format (name));
+  CATCH_MEM (sink->row = g_try_new (guchar, w * channels * sink->sample_size));
+#endif /* HAVE_GIMP_2_10 */
+
+  sink->fp = g_fopen (filename, "wb");
+  if (sink->fp == NULL)
+    {
+      g_message (_("Could not open '%s' for writing: %s"),
+                 gimp_filename_to_utf8 (filename), g_strerror (errno));
+      g_free (sink->row);
+      return LQR_ERROR;
+    }
+  sink->filename = g_strdup (filename);
+
+  fprintf (sink->fp,
+           "P7\nWIDTH %d\nHEIGHT %d\nDEPTH %d\nMAXVAL %d\nTUPLTYPE %s\nENDHDR\n",
+           w, h, channels, (sink->sample_size == 1) ? 255 : 65535,
+           tupltype[channels - 1]);
+
+  return LQR_OK;
+}
+
+/* src is a row of carver pixels, in the carver's colour depth */
+static gboolean
+file_sink_write_row (FileSink * sink, const guchar * src)
+{
+#ifdef HAVE_GIMP_2_10
+  gint i;
+  guint16 *sample;
+
+  babl_process (sink->fish, src, sink->row, sink->w);
+  if (sink->sample_size == 2)
+    {
+      sample = (guint16 *) sink->row;
+      for (i = 0; i < sink->w * sink->channels; i++)
+        {
+          sample[i] = GUINT16_TO_BE (sample[i]);
+        }
+    }
+  src = sink->row;
+#endif /* HAVE_GIMP_2_10 */
+
+  return fwrite (src, sink->channels * sink->sample_size, sink->w, sink->fp) ==
+    (gsize) sink->w;
+}
+
+static LqrRetVal
+file_sink_close (FileSink * sink)
+{
+  gboolean failed;
+  LqrRetVal ret = LQR_OK;
+
+  failed = ferror (sink->fp);
+  if ((fclose (sink->fp) != 0) || failed)
+    {
+      g_message (_("Error writing '%s': %s"),
+                 gimp_filename_to_utf8 (sink->filename), g_strerror (errno));
+      ret = LQR_ERROR;
+    }
+  g_free (sink->filename);
+  g_free (sink->row);
+
+  return ret;
+}
+
+/* The RGBA pixels of a seam map can only take depth + 1 values
+ * (one per seam, plus the transparent one for pixels which were
+ * not removed), so they are computed once and stored in a table
+ * indexed by the map values. Each entry holds the 4 bytes of the
+ * pixel in memory order */
+static guint32 *
+vmap_colour_table_new (gint depth, GimpRGB col_start, GimpRGB col_end)
+{
+  guint32 *table;
+  guchar pixel[4];
+  gdouble value;
+  gint vs;
+
+  LQR_TRY_N_N (table = g_try_new (guint32, depth + 1));
+
+  memset (pixel, 0, 4);
+  memcpy (&table[0], pixel, 4);
+
+  for (vs = 1; vs <= depth; vs++)
+    {
+      value = (double) (depth + 1 - vs) / (depth + 1);
+      pixel[0] = 255 * (value * col_start.r + (1 - value) * col_end.r);
+      pixel[1] = 255 * (value * col_start.g + (1 - value) * col_end.g);
+      pixel[2] = 255 * (value * col_start.b + (1 - value) * col_end.b);
+      pixel[3] = 255 * (0.5 * (1 + value));
+      memcpy (&table[vs], pixel, 4);
+    }
+
+  return table;
+}
+
+/* Fills a row of RGBA pixels from a row of the seam map; this is
+ * a plain gather with one 32 bit store per pixel, which the
+ * compiler can unroll and vectorize */
+static void
+vmap_colour_row (guint32 * dest, const gint * src, gint w,
+                 const guint32 * table)
+{
+  gint x;
+
+  for (x = 0; x < w; x++)
+    {
+      dest[x] = table[src[x]];
+    }
+}
+
+/* Computes the RGBA pixels of a whole seam map. It does not call
+ * into GIMP, so it may run in any thread */
+static guint32 *
+vmap_rasterize (LqrVMap * vmap, GimpRGB col_start, GimpRGB col_end)
+{
+  gint w, h, y;
+  gint *buffer;
+  guint32 *table;
+  guint32 *pixels;
+
+  w = lqr_vmap_get_width (vmap);
+  h = lqr_vmap_get_height (vmap);
+  buffer = lqr_vmap_get_data (vmap);
+
+  LQR_TRY_N_N (table = vmap_colour_table_new (lqr_vmap_get_depth (vmap),
+                                              col_start, col_end));
+  pixels = g_try_new (guint32, (gsize) w * h);
+  if (pixels != NULL)
+    {
+      for (y = 0; y < h; y++)
+        {
+          vmap_colour_row (pixels + (gsize) y * w, buffer + (gsize) y * w, w, table);
+        }
+    }
+  g_free (table);
+
+  return pixels;
+}
+
+/* Returns the layer which will hold a seam map of the given size:
+ * the one referenced by the argument, if still valid, otherwise a
+ * new one */
+static gint32
+vmap_layer_prepare (VMapFuncArg * arg, gint w, gint h)
+{
+  gint32 seam_layer_ID = -1;
+
+  if (arg->vmap_layer_ID_p)
+    {
+      seam_layer_ID = *arg->vmap_layer_ID_p;
+    }
+
+  if (!gimp_drawable_is_valid (seam_layer_ID))
+    {
+      seam_layer_ID =
+        gimp_layer_new (arg->image_ID, arg->name, w, h, GIMP_RGBA_IMAGE, 100,
+                        GIMP_NORMAL_MODE);
+      gimp_drawable_fill (seam_layer_ID, GIMP_TRANSPARENT_FILL);
+      gimp_image_insert_layer (arg->image_ID, seam_layer_ID, 0, -1);
+      gimp_layer_translate (seam_layer_ID, arg->x_off, arg->y_off);
+      if (arg->vmap_layer_ID_p)
+        {
+          *arg->vmap_layer_ID_p = seam_layer_ID;
+        }
+    }
+  else
+    {
+      gimp_layer_resize  (seam_layer_ID, w, h, 0, 0);
+    }
+
+  return seam_layer_ID;
+}
+
+/* Writes the pixels of a seam map to its layer, one stripe of
+ * tiles at a time */
+static void
+vmap_layer_upload (gint32 layer_ID, const guint32 * pixels, gint w, gint h)
+{
+  LayerSink sink;
+  gint y, stripe_h;
+
+  stripe_h = gimp_tile_height ();
+
+  layer_sink_open (&sink, layer_ID, LQR_COLDEPTH_8I, FALSE);
+
+  for (y = 0; y < h; y += stripe_h)
+    {
+      layer_sink_set_rect (&sink, (guchar *) (pixels + (gsize) y * w),
+                           0, y, w, MIN (stripe_h, h - y));
+      progress_task_update ((gdouble) MIN (y + stripe_h, h) / h);
+    }
+
+  layer_sink_close (&sink);
+  gimp_drawable_set_visible (layer_ID, TRUE);
+}
+
+static LqrRetVal
+write_depth_map (LqrVMap * vmap, gint32 image_ID, gchar * name,
+                 gboolean high_depth)
+{
+  gint w, h, x, y;
+  gint *buffer;
+  gint32 layer_ID;
+  LayerSink sink;
+  guchar *row8 = NULL;
+  guint16 *row16 = NULL;
+  gint update_step;
+
+  w = lqr_vmap_get_width (vmap);
+  h = lqr_vmap_get_height (vmap);
+  buffer = lqr_vmap_get_data (vmap);
+
+  if (high_depth)
+    {
+      CATCH_MEM (row16 = g_try_new (guint16, w));
+    }
+  else
+    {
+      CATCH_MEM (row8 = g_try_new (guchar, w));
+    }
+
+  progress_task_start (_("Drawing seam map..."));
+  update_step = MAX ((h - 1) / 20, 1);
+
+  layer_ID = gimp_layer_new (image_ID, name, w, h, GIMP_GRAY_IMAGE, 100,
+                             GIMP_NORMAL_MODE);
+  gimp_image_insert_layer (image_ID, layer_ID, 0, -1);
+
+  layer_sink_open (&sink, layer_ID,
+                   high_depth ? LQR_COLDEPTH_16I : LQR_COLDEPTH_8I, FALSE);
+
+  for (y = 0; y < h; y++)
+    {
+      if (high_depth)
+        {
+          for (x = 0; x < w; x++)
+            {
+              row16[x] = MIN (buffer[y * w + x], G_MAXUINT16);
+            }
+          layer_sink_set_rect (&sink, (guchar *) row16, 0, y, w, 1);
+        }
+      else
+        {
+          for (x = 0; x < w; x++)
+            {
+              row8[x] = MIN (buffer[y * w + x], G_MAXUINT8);
+            }
+          layer_sink_set_rect (&sink, row8, 0, y, w, 1);
+        }
+
+      if (y % update_step == 0)
+        {
+          progress_task_update ((gdouble) y / (h - 1));
+        }
+    }
+
+  layer_sink_close (&sink);
+
+  g_free (row8);
+  g_free (row16);
+
+  progress_task_end ();
+
+  return LQR_OK;
+}
+
+gint
+col_depth_size (LqrColDepth col_depth)
+{
+  switch (col_depth)
+    {
+      case LQR_COLDEPTH_16I:
+        return 2;
+      case LQR_COLDEPTH_32F:
+        return 4;
+      case LQR_COLDEPTH_64F:
+        return 8;
+      case LQR_COLDEPTH_8I:
+      default:
+        return 1;
+    }
+}
+
+#ifdef HAVE_GIMP_2_10
+
+/* The colour depth which matches the precision of a layer;
+ * half floats and 32 bit integers are carved as floats */
+static LqrColDepth
+layer_col_depth (gint32 layer_ID)
+{
+  const Babl *type;
+
+  type = babl_format_get_type (gimp_drawable_get_format (layer_ID), 0);
+
+  if (type == babl_type ("u8"))
+    {
+      return LQR_COLDEPTH_8I;
+    }
+  else if (type == babl_type ("u16"))
+    {
+      return LQR_COLDEPTH_16I;
+    }
+  else if (type == babl_type ("double"))
+    {
+      return LQR_COLDEPTH_64F;
+    }
+  return LQR_COLDEPTH_32F;
+}
+
+/* The format of a layer (same colour model, i.e. same channels
+ * and same gamma), with the component type of the given depth */
+static const Babl *
+layer_format (gint32 layer_ID, LqrColDepth col_depth)
+{
+  const gchar *model;
+  const gchar *type;
+  gchar name[LQR_MAX_NAME_LENGTH];
+
+  model = babl_get_name (babl_format_get_model (gimp_drawable_get_format (layer_ID)));
+
+  switch (col_depth)
+    {
+      case LQR_COLDEPTH_16I:
+        type = "u16";
+        break;
+      case LQR_COLDEPTH_32F:
+        type = "float";
+        break;
+      case LQR_COLDEPTH_64F:
+        type = "double";
+        break;
+      case LQR_COLDEPTH_8I:
+      default:
+        type = "u8";
+        break;
+    }
+
+  g_snprintf (name, LQR_MAX_NAME_LENGTH, "%s %s", model, type);
+  return babl_format (name);
+}
+
+/* Fetches an area of a layer with a single buffer call */
+static void
+layer_read_area (gint32 layer_ID, gint x0, gint y0, gint w, gint h,
+                 LqrColDepth col_depth, gpointer dest)
+{
+  GeglBuffer *buffer;
+
+  buffer = gimp_drawable_get_buffer (layer_ID);
+  gegl_buffer_get (buffer, GEGL_RECTANGLE (x0, y0, w, h), 1.0,
+                   layer_format (layer_ID, col_depth), dest,
+                   GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_NONE);
+  g_object_unref (buffer);
+}
+
+#endif /* HAVE_GIMP_2_10 */
+
+static void
+carver_setup_push (CarverSetup * setup, CarverJob * job)
+{
+  if (setup->holding)
+    {
+      setup->held = g_slist_prepend (setup->held, job);
+      return;
+    }
+#if GLIB_CHECK_VERSION (2, 36, 0)
+  if (setup->pool != NULL)
+    {
+      g_thread_pool_push (setup->pool, job, NULL);
+      return;
+    }
+#endif /* GLIB_CHECK_VERSION (2, 36, 0) */
+  carver_job_run (job, setup);
+}
+
+/* Reads the given masks and queues a job adding them to the carver */
+static void
+carver_setup_masks (CarverSetup * setup, CarverJobType type, gint n_layers,
+                    const gint32 * layer_ID, const gint * coeff,
+                    gint base_x_off, gint base_y_off, GHashTable * cache)
+{
+  CarverJob *job;
+
+  if (setup->read_ret != LQR_OK)
+    {
+      return;
+    }
+
+  job = g_try_new0 (CarverJob, 1);
+  if (job == NULL)
+    {
+      setup->read_ret = LQR_NOMEM;
+      return;
+    }
+  job->type = type;
+
+  setup->read_ret = mask_set_read (&job->masks, setup->width, setup->height,
+                                   n_layers, layer_ID, coeff,
+                                   base_x_off, base_y_off, cache);
+
+  if ((setup->read_ret == LQR_OK) && (setup->checksum != NULL))
+    {
+      mask_set_hash (setup->checksum, type, &job->masks);
+    }
+
+  /* unlike the rigidity mask, an empty bias needs no job */
+  if ((setup->read_ret != LQR_OK) ||
+      ((type == CARVER_JOB_BIAS) && (job->masks.n == 0)))
+    {
+      mask_set_clear (&job->masks);
+      g_free (job);
+      return;
+    }
+
+  carver_setup_push (setup, job);
+}
+
+static void
+carver_job_run (gpointer job_p, gpointer setup_p)
+{
+  CarverJob *job = job_p;
+  CarverSetup *setup = setup_p;
+
+  /* no calls to GIMP here, as those must all come from the main
+   * thread: the tile size was read beforehand */
+  if (setup->ret == LQR_OK)
+    {
+      switch (job->type)
+        {
+        case CARVER_JOB_INIT:
+          setup->ret = lqr_carver_init (setup->r, setup->delta_x, setup->rigidity);
+          break;
+        case CARVER_JOB_BIAS:
+          setup->ret = bias_apply (setup->r, &job->masks,
+                                   setup->tile_w, setup->tile_h);
+          break;
+        case CARVER_JOB_ALPHA_BIAS:
+          setup->ret = alpha_bias_apply (setup->r, job, setup->width,
+                                         setup->height, setup->tile_h);
+          break;
+        case CARVER_JOB_RIGMASK:
+          setup->ret = rigmask_apply (setup->r, &job->masks,
+                                      setup->tile_w, setup->tile_h);
+          break;
+        case CARVER_JOB_LOAD_VMAP:
+          setup->ret = lqr_vmap_load (setup->r, job->vmap);
+          break;
+        }
+    }
+
+  carver_job_free (job);
+}
+
+static void
+carver_job_free (CarverJob * job)
+{
+  mask_set_clear (&job->masks);
+  if (job->vmap != NULL)
+    {
+      lqr_vmap_destroy (job->vmap);
+    }
+  g_free (job);
+}
+
+static void
+carver_job_free_func (gpointer job, gpointer data)
+{
+  carver_job_free ((CarverJob *) job);
+}
+
+/* Feeds the masks of a job, as they will be applied, to a checksum */
+static void
+mask_set_hash (GChecksum * checksum, CarverJobType type, MaskSet * set)
+{
+  gint i, j, y;
+  guchar *row;
+  MaskSource *src;
+  MaskTile *tile;
+
+  row = g_new (guchar, gimp_tile_width ());
+
+  seam_cache_hash_int (checksum, type);
+  seam_cache_hash_int (checksum, set->n);
+  for (i = 0; i < set->n; i++)
+    {
+      src = &set->src[i];
+      seam_cache_hash_int (checksum, src->x_off);
+      seam_cache_hash_int (checksum, src->y_off);
+      seam_cache_hash_int (checksum, src->coeff);
+      seam_cache_hash_int (checksum, src->mask->n);
+      for (j = 0; j < src->mask->n; j++)
+        {
+          tile = &src->mask->tiles[j];
+          seam_cache_hash_int (checksum, tile->x);
+          seam_cache_hash_int (checksum, tile->y);
+          seam_cache_hash_int (checksum, tile->w);
+          seam_cache_hash_int (checksum, tile->h);
+          for (y = 0; y < tile->h; y++)
+            {
+              seam_cache_hash_data (checksum, mask_tile_row (tile, y, row),
+                                    tile->w);
+            }
+        }
+    }
+
+  g_free (row);
+}
+
+/* Reads the non-empty tiles of the mask layers which overlap the
+ * carver; layers with a zero ID or weight are left out */
+static LqrRetVal
+mask_set_read (MaskSet * set, gint width, gint height, gint n_layers,
+               const gint32 * layer_ID, const gint * coeff,
+               gint base_x_off, gint base_y_off, GHashTable * cache)
+{
+  gint i;
+  gint x, y, w, h;
+  MaskSource *src;
+
+  set->x1 = set->y1 = G_MAXINT;
+  set->x2 = set->y2 = 0;
+  set->n = 0;
+  for (i = 0; i < n_layers; i++)
+    {
+      src = &set->src[set->n];
+      if ((layer_ID[i] == 0) || (coeff[i] == 0) ||
+          !mask_area_clip (width, height, layer_ID[i], base_x_off, base_y_off,
+                           &x, &y, &w, &h, &src->x_off, &src->y_off))
+        {
+          continue;
+        }
+      src->mask = mask_tiles_read (layer_ID[i], x, y, w, h, cache);
+      if (src->mask == NULL)
+        {
+          return LQR_NOMEM;
+        }
+      src->coeff = coeff[i];
+      set->x1 = MIN (set->x1, src->x_off);
+      set->y1 = MIN (set->y1, src->y_off);
+      set->x2 = MAX (set->x2, src->x_off + w);
+      set->y2 = MAX (set->y2, src->y_off + h);
+      set->n++;
+    }
+
+  return LQR_OK;
+}
+
+static void
+mask_set_clear (MaskSet * set)
+{
+  gint i;
+
+  for (i = 0; i < set->n; i++)
+    {
+      mask_tiles_free (set->src[i].mask);
+    }
+  set->n = 0;
+}
+
+/* Adds the masks to the bias of the carver, each with its own weight.
+ * They are converted together into a plane of bias values, built one
+ * stripe of tiles at a time and submitted through the floating point
+ * bias API; stripes which all masks leave empty are skipped */
+static LqrRetVal
+bias_apply (LqrCarver * r, MaskSet * set, gint tile_w, gint tile_h)
+{
+  gint i, j, y;
+  gint plane_w, stripe_h;
+  gint sy, sh, ty, ty1, ty2;
+  gboolean used;
+  gdouble *plane;
+  guchar *row;
+  MaskSource *src;
+  MaskTile *tile;
+  LqrRetVal ret = LQR_OK;
+
+  plane_w = set->x2 - set->x1;
+  stripe_h = tile_h;
+  plane = g_try_new (gdouble, plane_w * stripe_h);
+  row = g_try_new (guchar, tile_w);
+  if ((plane == NULL) || (row == NULL))
+    {
+      g_free (plane);
+      g_free (row);
+      return LQR_NOMEM;
+    }
+
+  for (sy = set->y1; (sy < set->y2) && (ret == LQR_OK); sy += stripe_h)
+    {
+      sh = MIN (stripe_h, set->y2 - sy);
+      memset (plane, 0, plane_w * sh * sizeof (gdouble));
+      used = FALSE;
+
+      for (i = 0; i < set->n; i++)
+        {
+          src = &set->src[i];
+          for (j = 0; j < src->mask->n; j++)
+            {
+              tile = &src->mask->tiles[j];
+              ty = src->y_off + tile->y;
+              ty1 = MAX (ty, sy);
+              ty2 = MIN (ty + tile->h, sy + sh);
+              for (y = ty1; y < ty2; y++)
+                {
+                  bias_row_add (plane + (y - sy) * plane_w +
+                                (src->x_off + tile->x - set->x1),
+                                mask_tile_row (tile, y - ty, row),
+                                tile->w, src->coeff);
+                  used = TRUE;
+                }
+            }
+        }
+
+      /* liblqr adds half of bias_factor times the given values, which is
+       * what the rgb version does with the factor and the pixel intensity */
+      if (used)
+        {
+          ret = lqr_carver_bias_add_area (r, plane, 1, plane_w, sh,
+                                          set->x1, sy);
+        }
+    }
+
+  g_free (plane);
+  g_free (row);
+
+  return ret;
+}
+
+/* Adds coeff times the alpha of each pixel to the bias, one stripe
+ * at a time; fully transparent stripes are skipped */
+static LqrRetVal
+alpha_bias_apply (LqrCarver * r, CarverJob * job, gint width, gint height,
+                  gint stripe_h)
+{
+  gint x, y;
+  gint sy, sh;
+  gsize i;
+  gdouble a;
+  gdouble *plane;
+  gboolean used;
+  LqrRetVal ret = LQR_OK;
+
+  CATCH_MEM (plane = g_try_new (gdouble, width * stripe_h));
+
+  for (sy = 0; (sy < height) && (ret == LQR_OK); sy += stripe_h)
+    {
+      sh = MIN (stripe_h, height - sy);
+      used = FALSE;
+      for (y = 0; y < sh; y++)
+        {
+          i = (gsize) (sy + y) * width * job->channels + job->channels - 1;
+          for (x = 0; x < width; x++, i += job->channels)
+            {
+              a = sample_value (job->pixels, i, job->col_depth);
+              plane[y * width + x] = job->coeff * a;
+              used = used || (a != 0);
+            }
+        }
+      if (used)
+        {
+          ret = lqr_carver_bias_add_area (r, plane, 1, width, sh, 0, sy);
+        }
+    }
+
+  g_free (plane);
+
+  return ret;
+}
+
+/* A sample of a pixel buffer, scaled to [0, 1] */
+static gdouble
+sample_value (gconstpointer pixels, gsize i, LqrColDepth col_depth)
+{
+  switch (col_depth)
+    {
+      case LQR_COLDEPTH_16I:
+        return ((const guint16 *) pixels)[i] / 65535.0;
+      case LQR_COLDEPTH_32F:
+        return ((const gfloat *) pixels)[i];
+      case LQR_COLDEPTH_64F:
+        return ((const gdouble *) pixels)[i];
+      case LQR_COLDEPTH_8I:
+      default:
+        return ((const guchar *) pixels)[i] / 255.0;
+    }
+}
+
+/* Adds the (single) mask of the set as the rigidity mask of the
+ * carver; an empty rigidity mask still needs to be there */
+static LqrRetVal
+rigmask_apply (LqrCarver * r, MaskSet * set, gint tile_w, gint tile_h)
+{
+  MaskSource *src;
+  MaskTile *tile;
+  const guchar *data;
+  guchar *buf;
+  gint i, j;
+  LqrRetVal ret = LQR_OK;
+
+  src = &set->src[0];
+  if ((set->n == 0) || (src->mask->n == 0))
+    {
+      return lqr_carver_rigmask_add_xy (r, 0, 0, 0);
+    }
+
+  buf = g_try_new (guchar, tile_w * tile_h);
+  if (buf == NULL)
+    {
+      return LQR_NOMEM;
+    }
+
+  /* the tiles are submitted as one-channel images, the bitset
+   * ones being expanded first */
+  for (i = 0; (i < src->mask->n) && (ret == LQR_OK); i++)
+    {
+      tile = &src->mask->tiles[i];
+      data = tile->data;
+      if (data == NULL)
+        {
+          for (j = 0; j < tile->h; j++)
+            {
+              mask_tile_row (tile, j, buf + j * tile->w);
+            }
+          data = buf;
+        }
+      ret = lqr_carver_rigmask_add_rgb_area (r, (guchar *) data, 1,
+                                             tile->w, tile->h,
+                                             src->x_off + tile->x,
+                                             src->y_off + tile->y);
+    }
+
+  g_free (buf);
+
+  return ret;
+}
+
+/* Returns the number of carved pixels which all the lines of a
+ * seam map have in common (the lines are the rows for horizontal
+ * maps), or -1 if they differ */
+static gint
+vmap_lines_depth (const gint * data, gint w, gint h, gint orientation)
+{
+  gint lines, len;
+  gint line, k;
+  gint n, depth = -1;
+
+  lines = orientation ? w : h;
+  len = orientation ? h : w;
+
+  for (line = 0; line < lines; line++)
+    {
+      n = 0;
+      for (k = 0; k < len; k++)
+        {
+          n += (data[orientation ? k * w + line : line * w + k] != 0);
+        }
+      if ((depth >= 0) && (n != depth))
+        {
+          return -1;
+        }
+      depth = n;
+    }
+
+  return depth;
+}
+
+/* Replaces the values of the carved pixels of each line with their
+ * ranks along the line, starting from 1; fails on ties, i.e. when
+ * the map was clamped or quantized too coarsely */
+static gboolean
+vmap_lines_rank (gint * data, gint w, gint h, gint orientation, gint depth,
+                 VMapRank * ranks)
+{
+  gint lines, len;
+  gint line, k, n;
+  gint index;
+
+  lines = orientation ? w : h;
+  len = orientation ? h : w;
+
+  for (line = 0; line < lines; line++)
+    {
+      n = 0;
+      for (k = 0; k < len; k++)
+        {
+          index = orientation ? k * w + line : line * w + k;
+          if (data[index] != 0)
+            {
+              ranks[n].value = data[index];
+              ranks[n].index = index;
+              n++;
+            }
+        }
+
+      qsort (ranks, depth, sizeof (VMapRank), vmap_rank_compare);
+
+      for (k = 0; k < depth; k++)
+        {
+          if ((k > 0) && (ranks[k].value == ranks[k - 1].value))
+            {
+              return FALSE;
+            }
+          data[ranks[k].index] = k + 1;
+        }
+    }
+
+  return TRUE;
+}
+
+static int
+vmap_rank_compare (const void * a, const void * b)
+{
+  const VMapRank *ra = a;
+  const VMapRank *rb = b;
+
+  return (ra->value > rb->value) - (ra->value < rb->value);
+}
+
+#ifndef HAVE_GIMP_2_10
+/* Reads an area of the layer into buffer, which holds w * h pixels */
+static void
+rgb_buffer_read_area (gint32 layer_ID, gint x0, gint y0, gint w, gint h,
+                      guchar * buffer)
+{
+  gint y, bpp;
+  GimpDrawable *drawable;
+  GimpPixelRgn rgn_in;
+  gpointer pr;
+  guchar *src, *dest;
+  gint ntiles, tiles_done;
+  gint update_step;
+
+  progress_task_start (_("Parsing layer..."));
+
+  bpp = gimp_drawable_bpp (layer_ID);
+
+  drawable = gimp_drawable_get (layer_ID);
+
+  gimp_pixel_rgn_init (&rgn_in, drawable, x0, y0, w, h, FALSE, FALSE);
+
+  /* walk the drawable tile by tile, so that each tile is
+   * transferred only once, and copy it in place */
+  ntiles = count_tiles (x0, y0, w, h);
+  update_step = MAX (ntiles / 20, 1);
+  tiles_done = 0;
+
+  for (pr = gimp_pixel_rgns_register (1, &rgn_in); pr != NULL;
+       pr = gimp_pixel_rgns_process (pr))
+    {
+      src = rgn_in.data;
+      dest = buffer + ((rgn_in.y - y0) * w + (rgn_in.x - x0)) * bpp;
+      for (y = 0; y < rgn_in.h; y++)
+        {
+          memcpy (dest, src, rgn_in.w * bpp);
+          src += rgn_in.rowstride;
+          dest += w * bpp;
+        }
+
+      tiles_done++;
+      if (tiles_done % update_step == 0)
+        {
+          progress_task_update ((gdouble) tiles_done / ntiles);
+        }
+    }
+
+  gimp_drawable_detach (drawable);
+
+  progress_task_end ();
+}
+#endif /* HAVE_GIMP_2_10 */
+
+/* Traces the seam of the lowest energy through the band of a coarse
+ * seam, given by its position in each coarse line, and carves it at
+ * the given level */
+static LqrRetVal
+vmap_trace_seam (VMapTrace * t, const gint * coarse_pos, gint coarse_lines,
+                 gint coarse_len, gint margin, gint level)
+{
+  gint line, coarse_line;
+  gint kmin, kmax, lo, hi;
+  gint i, j, k, a, b, best, prev_best;
+  gfloat jump;
+  gint n, n_line;
+
+  /* the band of each line spans the coarse seam in the coarse lines
+   * around it, so that the seam can follow it from one to the next */
+  n = 0;
+  for (line = 0; line < t->lines; line++)
+    {
+      coarse_line = (gint) ((gint64) line * coarse_lines / t->lines);
+      kmin = coarse_pos[coarse_line];
+      kmax = kmin;
+      if (coarse_line > 0)
+        {
+          kmin = MIN (kmin, coarse_pos[coarse_line - 1]);
+          kmax = MAX (kmax, coarse_pos[coarse_line - 1]);
+        }
+      if (coarse_line < coarse_lines - 1)
+        {
+          kmin = MIN (kmin, coarse_pos[coarse_line + 1]);
+          kmax = MAX (kmax, coarse_pos[coarse_line + 1]);
+        }
+      lo = MAX ((gint) ((gint64) kmin * t->len / coarse_len) - margin, 0);
+      hi = MIN ((gint) ((gint64) (kmax + 1) * t->len / coarse_len) + margin, t->len);
+
+      /* a band eaten up by the seams before is widened */
+      t->start[line] = n;
+      while ((n_line = vmap_trace_band (t, line, lo, hi, n)) == 0)
+        {
+          lo = MAX (lo - margin, 0);
+          hi = MIN (hi + margin, t->len);
+        }
+      if (n_line < 0)
+        {
+          return LQR_NOMEM;
+        }
+      n += n_line;
+    }
+  t->start[t->lines] = n;
+
+  for (j = t->start[0]; j < t->start[1]; j++)
+    {
+      t->cost[j] = pixel_energy (t, 0, t->pos[j]);
+      t->from[j] = -1;
+    }
+
+  for (line = 1; line < t->lines; line++)
+    {
+      a = t->start[line - 1];
+      b = t->start[line];
+      prev_best = a;
+      for (i = a + 1; i < b; i++)
+        {
+          if (t->cost[i] < t->cost[prev_best])
+            {
+              prev_best = i;
+            }
+        }
+
+      /* both bands are sorted, so the pixels within reach of each
+       * one of this line start further on the line before */
+      i = a;
+      for (j = b; j < t->start[line + 1]; j++)
+        {
+          while ((i < b) && (t->cur[i] < t->cur[j] - t->delta_x))
+            {
+              i++;
+            }
+          best = -1;
+          for (k = i; (k < b) && (t->cur[k] <= t->cur[j] + t->delta_x); k++)
+            {
+              if ((best < 0) || (t->cost[k] < t->cost[best]))
+                {
+                  best = k;
+                }
+            }
+          /* out of reach of the band before, the seam would have to
+           * jump, which costs more than any seam which does not */
+          jump = 0;
+          if (best < 0)
+            {
+              best = prev_best;
+              jump = t->lines + 1;
+            }
+          t->cost[j] = t->cost[best] + pixel_energy (t, line, t->pos[j]) + jump;
+          t->from[j] = best;
+        }
+    }
+
+  best = t->start[t->lines - 1];
+  for (j = best + 1; j < n; j++)
+    {
+      if (t->cost[j] < t->cost[best])
+        {
+          best = j;
+        }
+    }
+
+  for (line = t->lines - 1; line >= 0; line--)
+    {
+      if (t->orientation)
+        {
+          t->data[(gsize) t->pos[best] * t->width + line] = level;
+        }
+      else
+        {
+          t->data[(gsize) line * t->width + t->pos[best]] = level;
+        }
+      carved_add (t->carved + (gsize) line * t->len, t->len, t->pos[best]);
+      best = t->from[best];
+    }
+
+  return LQR_OK;
+}
+
+/* Gathers the pixels of a line between lo and hi which are not
+ * carved yet, from index n of the band arrays on; returns their
+ * number, or -1 if out of memory */
+static gint
+vmap_trace_band (VMapTrace * t, gint line, gint lo, gint hi, gint n)
+{
+  const gint *data;
+  gint stride;
+  gint p, carved, n_line;
+
+  if (!vmap_trace_reserve (t, (gsize) n + hi - lo))
+    {
+      return -1;
+    }
+
+  data = t->orientation ? t->data + line : t->data + (gsize) line * t->width;
+  stride = t->orientation ? t->width : 1;
+  carved = carved_count (t->carved + (gsize) line * t->len, lo);
+  n_line = 0;
+  for (p = lo; p < hi; p++)
+    {
+      if (data[(gsize) p * stride] != 0)
+        {
+          carved++;
+          continue;
+        }
+      t->pos[n + n_line] = p;
+      t->cur[n + n_line] = p - carved;
+      n_line++;
+    }
+
+  return n_line;
+}
+
+static gboolean
+vmap_trace_reserve (VMapTrace * t, gsize size)
+{
+  gint *pos, *cur, *from;
+  gfloat *cost;
+
+  if (size <= t->size)
+    {
+      return TRUE;
+    }
+  size = MAX (size, 2 * t->size);
+
+  pos = g_try_renew (gint, t->pos, size);
+  if (pos == NULL)
+    {
+      return FALSE;
+    }
+  t->pos = pos;
+  cur = g_try_renew (gint, t->cur, size);
+  if (cur == NULL)
+    {
+      return FALSE;
+    }
+  t->cur = cur;
+  cost = g_try_renew (gfloat, t->cost, size);
+  if (cost == NULL)
+    {
+      return FALSE;
+    }
+  t->cost = cost;
+  from = g_try_renew (gint, t->from, size);
+  if (from == NULL)
+    {
+      return FALSE;
+    }
+  t->from = from;
+
+  t->size = size;
+  return TRUE;
+}
+
+/* The gradient of the pixels at full size, in [0, 1], from the
+ * differences between their neighbours in either direction */
+static gfloat
+pixel_energy (VMapTrace * t, gint line, gint pos)
+{
+  gint x, y, c;
+  gsize left, right, up, down;
+  gdouble gx, gy;
+
+  x = t->orientation ? line : pos;
+  y = t->orientation ? pos : line;
+
+  left = ((gsize) y * t->width + MAX (x - 1, 0)) * t->channels;
+  right = ((gsize) y * t->width + MIN (x + 1, t->width - 1)) * t->channels;
+  up = ((gsize) MAX (y - 1, 0) * t->width + x) * t->channels;
+  down = ((gsize) MIN (y + 1, t->height - 1) * t->width + x) * t->channels;
+
+  gx = 0;
+  gy = 0;
+  for (c = 0; c < t->n_colours; c++)
+    {
+      gx += ABS (sample_value (t->pixels, right + c, t->col_depth) -
+                 sample_value (t->pixels, left + c, t->col_depth));
+      gy += ABS (sample_value (t->pixels, down + c, t->col_depth) -
+                 sample_value (t->pixels, up + c, t->col_depth));
+    }
+
+  return (gfloat) ((gx + gy) / (2 * t->n_colours));
+}
+
+/* Marks a pixel of a line as carved, in the Fenwick tree of the
+ * line, which has len entries */
+static void
+carved_add (gint * tree, gint len, gint pos)
+{
+  gint i;
+
+  for (i = pos + 1; i <= len; i += i & -i)
+    {
+      tree[i - 1]++;
+    }
+}
+
+/* The number of carved pixels of a line before pos */
+static gint
+carved_count (const gint * tree, gint pos)
+{
+  gint i, count = 0;
+
+  for (i = pos; i > 0; i -= i & -i)
+    {
+      count += tree[i - 1];
+    }
+
+  return count;
 }
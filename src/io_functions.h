@@ -40,16 +40,92 @@ struct _VMapFuncArg
 
 #define VMAP_FUNC_ARG(data) ((VMapFuncArg*)(data))
 
+/* The deepest seam maps which can be read back: the seams of a colour
+ * map are told apart by their opacity, which takes about 128 values,
+ * and those of an 8 bit depth map by a byte */
+#define VMAP_COLOUR_MAX_DEPTH (126)
+#define VMAP_DEPTH8_MAX_DEPTH (G_MAXUINT8)
+
+/* The non-empty tiles of a mask layer; the tile offsets are
+ * relative to the origin of the area which was read. Each pixel is
+ * stored as a single intensity byte (the mean of its colour channels,
+ * weighted by its alpha); tiles holding at most two distinct
+ * intensities are stored as a bitset selecting one of value[0],
+ * value[1], in which case data is NULL */
+
+typedef struct
+{
+  gint x;
+  gint y;
+  gint w;
+  gint h;
+  guchar *data;
+  guchar *bits;
+  guchar value[2];
+} MaskTile;
+
+typedef struct
+{
+  gint bpp;                     /* bytes per pixel of the source layer */
+  gint n;
+  MaskTile *tiles;
+} MaskTileList;
+
+/* A carver being initialized on a worker thread,
+ * see carver_setup_start */
+
+typedef struct _CarverSetup CarverSetup;
+
 /* INPUT/OUTPUT FUNCTIONS */
 
+gint layer_channels (gint32 layer_ID);
+gint col_depth_size (LqrColDepth col_depth);
+gpointer native_buffer_from_layer (gint32 layer_ID, LqrColDepth * col_depth);
+gpointer native_buffer_from_layer_area (gint32 layer_ID, gint x0, gint y0,
+                                        gint w, gint h, LqrColDepth * col_depth);
+LqrCarver *carver_new_from_buffer (gpointer buffer, gint w, gint h, gint channels,
+                                   LqrColDepth col_depth);
 guchar *rgb_buffer_from_layer (gint32 layer_ID);
-LqrRetVal update_bias (LqrCarver * r, gint32 layer_ID, gint bias_factor,
-                       gint base_x_off, gint base_y_off);
-LqrRetVal set_rigmask (LqrCarver * r, gint32 layer_ID, gint base_x_off, gint base_y_off);
+guchar *rgb_buffer_from_layer_area (gint32 layer_ID, gint x0, gint y0,
+                                    gint w, gint h);
+MaskTileList *mask_tiles_from_layer_area (gint32 layer_ID, gint x0, gint y0,
+                                          gint w, gint h);
+MaskTileList *mask_tiles_from_buffer (const guchar * buffer, gint buf_w, gint bpp,
+                                      gint x0, gint y0, gint w, gint h);
+void mask_tiles_free (MaskTileList * mask);
+GHashTable *layer_cache_new (void);
+guchar *layer_cache_get (GHashTable * cache, gint32 layer_ID);
+guchar *layer_cache_steal (GHashTable * cache, gint32 layer_ID);
+void layer_cache_destroy (GHashTable * cache);
+CarverSetup *carver_setup_start (LqrCarver * r, gint delta_x, gfloat rigidity,
+                                 GChecksum * checksum, gboolean hold);
+void carver_setup_bias (CarverSetup * setup, gint32 pres_layer_ID, gint pres_coeff,
+                        gint32 disc_layer_ID, gint disc_coeff,
+                        gint base_x_off, gint base_y_off, GHashTable * cache);
+void carver_setup_alpha_bias (CarverSetup * setup, gconstpointer pixels,
+                              gint channels, LqrColDepth col_depth, gint coeff);
+void carver_setup_rigmask (CarverSetup * setup, gint32 layer_ID,
+                           gint base_x_off, gint base_y_off, GHashTable * cache);
+void carver_setup_release (CarverSetup * setup, LqrVMap * vmap);
+LqrRetVal carver_setup_finish (CarverSetup * setup);
 LqrRetVal write_carver_to_layer (LqrCarver * r, gint32 layer_ID);
+void write_buffer_to_layer_area (gpointer buffer, LqrColDepth col_depth,
+                                 gint32 layer_ID, gint x0, gint y0,
+                                 gint w, gint h);
+LqrRetVal write_carver_to_layer_area (LqrCarver * r, gint32 layer_ID,
+                                      gint x0, gint y0);
+LqrRetVal write_carver_to_file (LqrCarver * r, gint32 layer_ID,
+                                const gchar * filename);
 LqrRetVal write_vmap_to_layer (LqrVMap * vmap, gpointer data);
 LqrRetVal write_all_vmaps (LqrVMapList * list, gint32 image_ID,
                            gchar * orig_name, gint x_off, gint y_off,
                            GimpRGB col_start, GimpRGB col_end);
+LqrRetVal write_all_depth_maps (LqrVMapList * list, gchar * orig_name,
+                                gboolean high_depth);
+gint vmap_list_max_depth (LqrVMapList * list);
+LqrRetVal vmap_from_layer (gint32 layer_ID, LqrVMap ** vmap);
+LqrRetVal vmap_project (LqrVMap * coarse, gconstpointer pixels, gint width,
+                        gint height, gint channels, LqrColDepth col_depth,
+                        gint depth, gint delta_x, LqrVMap ** vmap);
 
 #endif /* __IO_FUNCTIONS__ */
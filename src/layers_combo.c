@@ -29,6 +29,7 @@
 #include "main.h"
 #include "preview.h"
 #include "layers_combo.h"
+#include "io_functions.h"
 
 extern GtkWidget * dlg;
 
@@ -275,15 +276,14 @@ gint
 guess_new_size (GtkWidget * button, PreviewData * p_data, GuessDir direction)
 {
   gint32 disc_layer_ID;
-  GimpDrawable *drawable;
   gint z1, z2, k;
   gint z1min, z1max, z2max;
   gint width, height;
   gint lw, lh;
   gint x_off, y_off;
   gint bpp, c_bpp;
-  GimpPixelRgn rgn_in;
-  guchar *line;
+  guchar *area;
+  guchar *pixel;
   gboolean has_alpha;
   gdouble sum;
   gint mask_size;
@@ -310,13 +310,9 @@ guess_new_size (GtkWidget * button, PreviewData * p_data, GuessDir direction)
   width = gimp_drawable_width (disc_layer_ID);
   height = gimp_drawable_height (disc_layer_ID);
   has_alpha = gimp_drawable_has_alpha (disc_layer_ID);
-  bpp = gimp_drawable_bpp (disc_layer_ID);
+  bpp = layer_channels (disc_layer_ID);
   c_bpp = bpp - (has_alpha ? 1 : 0);
 
-  drawable = gimp_drawable_get (disc_layer_ID);
-  gimp_pixel_rgn_init (&rgn_in, drawable, 0, 0, width, height, FALSE, FALSE);
-
-
   gimp_drawable_offsets (disc_layer_ID, &x_off, &y_off);
 
   x_off -= p_data->x_off;
@@ -342,33 +338,44 @@ guess_new_size (GtkWidget * button, PreviewData * p_data, GuessDir direction)
         return 0;
     }
 
-  line = g_try_new (guchar, bpp * z2max);
+  if ((lw <= 0) || (lh <= 0))
+    {
+      return old_size;
+    }
 
-  for (z1 = z1min; z1 < z1max; z1++)
+  /* the overlapping part of the layer is read at once, 8 bit per channel */
+  area = rgb_buffer_from_layer_area (disc_layer_ID, MAX (0, -x_off), MAX (0, -y_off), lw, lh);
+  if (area == NULL)
     {
-      switch (direction)
-        {
-          case GUESS_DIR_HOR:
-            gimp_pixel_rgn_get_row (&rgn_in, line, MAX (0, -x_off), z1 - y_off, z2max);
-            break;
-          case GUESS_DIR_VERT:
-            gimp_pixel_rgn_get_col (&rgn_in, line, z1 - x_off, MAX (0, -y_off), z2max);
-            break;
-        }
+      return old_size;
+    }
 
+  for (z1 = z1min; z1 < z1max; z1++)
+    {
       mask_size = 0;
       for (z2 = 0; z2 < z2max; z2++)
 	{
+	  switch (direction)
+	    {
+	      case GUESS_DIR_HOR:
+		pixel = area + ((z1 - z1min) * lw + z2) * bpp;
+		break;
+	      case GUESS_DIR_VERT:
+	      default:
+		pixel = area + (z2 * lw + z1 - z1min) * bpp;
+		break;
+	    }
+
 	  sum = 0;
 	  for (k = 0; k < c_bpp; k++)
 	    {
-	      sum += line[bpp * z2 + k];
+	      sum += pixel[k];
 	    }
 
 	  sum /= (255 * c_bpp);
 	  if (has_alpha)
 	    {
-	      sum *= (gdouble) line[bpp * (z2 + 1) - 1] / 255;
+	      sum *= (gdouble) pixel[bpp - 1] / 255;
 	    }
 
 	  if (sum >= (0.5 / c_bpp))
@@ -385,8 +392,7 @@ guess_new_size (GtkWidget * button, PreviewData * p_data, GuessDir direction)
 
   new_size = old_size - max_mask_size;
 
-  g_free (line);
-  gimp_drawable_detach (drawable);
+  g_free (area);
 
   return new_size;
 }
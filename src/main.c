@@ -33,6 +33,8 @@
 #include "main.h"
 #include "interface.h"
 #include "render.h"
+#include "progress.h"
+#include "scratch.h"
 #include "interface_I.h"
 #include "interface_aux.h"
 
@@ -43,7 +45,7 @@ static void set_aux_layer_name(gint layer_ID, gboolean status, gchar * name);
 static void save_vals (void);
 static void retrieve_vals (void);
 static void retrieve_vals_use_aux_layers_names (gint32 image_ID);
-static void noninteractive_read_vals (const GimpParam * param);
+static gboolean noninteractive_read_vals (const GimpParam * param, gint n_params);
 static void install_custom_signals();
 static void cancel_work_on_aux_layer(void);
 #if defined(G_OS_WIN32)
@@ -72,8 +74,8 @@ const PlugInVals default_vals = {
   150,				/* enl step */
   TRUE,                         /* resize aux layers */
   TRUE,                         /* resize canvas */
-  OUTPUT_TARGET_SAME_LAYER,     /* output target (same layer, new layer, new image) */
-  FALSE,                        /* output seams */
+  OUTPUT_TARGET_SAME_LAYER,     /* output target (same layer, new layer, new image, file) */
+  SEAMS_OUTPUT_NONE,            /* output seams (none, colour map, 8 or 16 bit depth map) */
   LQR_EF_GRAD_XABS,             /* nrg func */
   LQR_RES_ORDER_HOR,            /* resize order */
   GIMP_MASK_APPLY,              /* mask behavior */
@@ -84,6 +86,17 @@ const PlugInVals default_vals = {
   "",                           /* disc_layer_name */
   "",                           /* rigmask_layer_name */
   "",                           /* selected layer name */
+  "",                           /* output file */
+  FALSE,                        /* preserve from the alpha channel */
+  FALSE,                        /* seam cache */
+  FALSE,                        /* seam parasite */
+  OTHER_LAYERS_NONE,            /* other layers */
+  "",                           /* group driver name */
+  0,                            /* number of extra targets */
+  {0},                          /* extra targets */
+  1,                            /* pyramid factor */
+  0,                            /* memory limit */
+  "",                           /* scratch directory */
 };
 
 const PlugInColVals default_col_vals = {
@@ -179,8 +192,8 @@ static GimpParamDef args[] = {
   {GIMP_PDB_INT32, "resize_aux_layers",
    "Whether to resize auxiliary layers"},
   {GIMP_PDB_INT32, "resize_canvas", "Whether to resize canvas"},
-  {GIMP_PDB_INT32, "output_target", "Output target (same layer, new layer, new image)"},
-  {GIMP_PDB_INT32, "seams", "Whether to output the seam map"},
+  {GIMP_PDB_INT32, "output_target", "Output target (0: same layer, 1: new layer, 2: new image, 3: file)"},
+  {GIMP_PDB_INT32, "seams", "Seam map output (0: none, 1: colour map, 2: 8 bit depth map, 3: 16 bit depth map)"},
   {GIMP_PDB_INT32, "nrg_func", "Energy function to use"},
   {GIMP_PDB_INT32, "res_order", "Resize order"},
   {GIMP_PDB_INT32, "mask_behavior", "What to do with masks"},
@@ -191,10 +204,35 @@ static GimpParamDef args[] = {
   {GIMP_PDB_STRING, "disc_layer_name", "Discard layer name (for noninteractive mode only)"},
   {GIMP_PDB_STRING, "rigmask_layer_name", "Rigidity mask layer name (for noninteractive mode only)"},
   {GIMP_PDB_STRING, "selected_layer_name", "Selected layer name (for noninteractive mode only)"},
+  {GIMP_PDB_STRING, "output_file", "File written as PAM when output_target is 3, in place of the rescaled layer (for noninteractive mode only)"},
+  {GIMP_PDB_INT32, "pres_from_alpha", "Whether to preserve the opaque areas of the layer, using its own alpha channel as a preservation mask (with strength pres_coeff)"},
+  {GIMP_PDB_INT32, "seam_cache", "Whether to reuse the seams found by earlier runs on the same data, kept packed in the user's cache directory, up to 256 MiB, the least recently used going first (for noninteractive mode only; used when shrinking in a single direction)"},
+  {GIMP_PDB_INT32, "seam_parasite", "Whether to keep the seams with the source layer, as a parasite, for later runs on the same data (for noninteractive mode only; used when shrinking in a single direction, and not when output_target is 0)"},
+  {GIMP_PDB_INT32, "other_layers", "Other layers to carve along with the drawable, with the same seams (0: none, 1: linked layers, 2: all layers; layer groups, and the layers used as masks, are left alone)"},
+  {GIMP_PDB_STRING, "group_driver_name", "When the drawable is a layer group, the name of the child layer which the seams are computed on (empty: the projection of the group); all the children are rescaled along (for noninteractive mode only)"},
+  {GIMP_PDB_INT32, "num_targets", "Number of entries in targets (twice the number of extra target sizes)"},
+  {GIMP_PDB_INT32ARRAY, "targets", "Extra target sizes, as width, height pairs which reduce the same single dimension as width and height (up to 16; for noninteractive mode only)"},
+  {GIMP_PDB_INT32, "pyramid_factor", "When greater than 1, the seams are searched on a copy of the layer scaled down by this factor, then refined at full size (used when shrinking in a single direction)"},
+  {GIMP_PDB_INT32, "memory_limit", "Memory limit of the carver, in MiB (0: none); larger layers are carved in stripes when possible, whose seams may bend where the stripes meet, or else refused"},
+  {GIMP_PDB_STRING, "scratch_dir", "Directory for memory mapped files holding the large pixel buffers, outside of memory_limit (empty: none)"},
+};
+
+static GimpParamDef apply_vmap_args[] = {
+  {GIMP_PDB_INT32, "run_mode", "Interactive, non-interactive"},
+  {GIMP_PDB_IMAGE, "image", "Input image"},
+  {GIMP_PDB_DRAWABLE, "drawable", "Input drawable"},
+  {GIMP_PDB_DRAWABLE, "vmap_drawable", "Seam map output by plug-in-lqr, of the same size as the input drawable; only 16 bit depth maps hold any number of seams (colour maps hold up to 126, 8 bit depth maps up to 255)"},
+  {GIMP_PDB_INT32, "width", "Final width (only reduced, for maps of vertical seams)"},
+  {GIMP_PDB_INT32, "height", "Final height (only reduced, for maps of horizontal seams)"},
+  {GIMP_PDB_INT32, "resize_canvas", "Whether to resize canvas"},
 };
 
 static int args_num;
 
+/* the arguments up to selected_layer_name, which older scripts
+ * pass; the later ones then keep their default values */
+#define LEGACY_ARGS_NUM (27)
+
 GimpPlugInInfo PLUG_IN_INFO = {
   NULL,                         /* init_proc  */
   NULL,                         /* quit_proc  */
@@ -239,6 +277,18 @@ static void query (void)
                           GIMP_PLUGIN, args_num, 0, args, NULL);
 
   gimp_plugin_menu_register (PLUG_IN_NAME, "<Image>/Layer/");
+
+  gimp_install_procedure (PLUG_IN_APPLY_VMAP_NAME,
+                          "Resize a layer along the seams of a stored seam map",
+                          "Resize a layer by removing the seams recorded in a seam map "
+                          "output by an earlier run of plug-in-lqr, without computing "
+                          "them again: all the layers of the same size carved with the "
+                          "same map are carved alike",
+                          "Carlo Baldassi <carlobaldassi@gmail.com>",
+                          "Carlo Baldassi <carlobaldassi@gmail.com>", "2010",
+                          NULL, "RGB*, GRAY*",
+                          GIMP_PLUGIN, G_N_ELEMENTS (apply_vmap_args), 0,
+                          apply_vmap_args, NULL);
 }
 
 
@@ -260,6 +310,8 @@ run (const gchar * name,
   gint dialog_I_resp;
   gint dialog_aux_resp;
   gboolean render_success = FALSE;
+  gboolean apply_vmap = FALSE;
+  gint32 vmap_layer_ID = -1;
 
   *nreturn_vals = 1;
   *return_vals = values;
@@ -275,6 +327,12 @@ run (const gchar * name,
 #endif
   textdomain (GETTEXT_PACKAGE);
 
+#ifdef HAVE_GIMP_2_10
+  /* pixels are exchanged in the drawables' own precision */
+  gegl_init (NULL, NULL);
+  gimp_plugin_enable_precision ();
+#endif /* HAVE_GIMP_2_10 */
+
   args_num = G_N_ELEMENTS (args);
 
   run_mode = param[0].data.d_int32;
@@ -306,21 +364,28 @@ run (const gchar * name,
       switch (run_mode)
         {
         case GIMP_RUN_NONINTERACTIVE:
-          if (n_params != args_num)
+          if ((n_params != args_num) && (n_params != LEGACY_ARGS_NUM))
             {
               fprintf(stderr, "gimp-lqr-plugin: error: wrong number of arguments\n");
               fflush(stderr);
               status = GIMP_PDB_CALLING_ERROR;
             }
+          else if (!noninteractive_read_vals (param, n_params))
+            {
+              fprintf(stderr, "gimp-lqr-plugin: error: invalid extra target sizes\n");
+              fflush(stderr);
+              status = GIMP_PDB_CALLING_ERROR;
+            }
           else
             {
-              noninteractive_read_vals (param);
               layer_ID = drawable_vals.layer_ID;
+              scratch_set_dir (vals.scratch_dir);
             }
           break;
 
         case GIMP_RUN_INTERACTIVE:
           retrieve_vals();
+          scratch_set_dir (vals.scratch_dir);
 
           install_custom_signals();
 
@@ -387,12 +452,31 @@ run (const gchar * name,
 
         case GIMP_RUN_WITH_LAST_VALS:
           retrieve_vals_use_aux_layers_names(image_ID);
+          scratch_set_dir (vals.scratch_dir);
           break;
 
         default:
           break;
         }
     }
+  else if (strcmp (name, PLUG_IN_APPLY_VMAP_NAME) == 0)
+    {
+      /* no dialog: all run modes take the arguments as given */
+      if (n_params != G_N_ELEMENTS (apply_vmap_args))
+        {
+          fprintf(stderr, "gimp-lqr-plugin: error: wrong number of arguments\n");
+          fflush(stderr);
+          status = GIMP_PDB_CALLING_ERROR;
+        }
+      else
+        {
+          apply_vmap = TRUE;
+          vmap_layer_ID = param[3].data.d_drawable;
+          vals.new_width = param[4].data.d_int32;
+          vals.new_height = param[5].data.d_int32;
+          vals.resize_canvas = param[6].data.d_int32;
+        }
+    }
   else
     {
       status = GIMP_PDB_CALLING_ERROR;
@@ -412,11 +496,31 @@ run (const gchar * name,
       ui_vals.last_layer_ID = layer_ID;
       gimp_image_undo_group_start (image_ID);
       render_success = TRUE;
-      if (run_render)
+      if (apply_vmap)
+        {
+          progress_run_start (_("Liquid rescale"));
+          render_success = render_apply_vmap (&image_vals, &drawable_vals,
+                                              &vals, vmap_layer_ID);
+          progress_run_end ();
+          if (!render_success)
+            {
+              status = GIMP_PDB_EXECUTION_ERROR;
+            }
+        }
+      else if (run_render &&
+               render_stripes_wanted (&image_vals, &drawable_vals, &vals))
+        {
+          progress_run_start (_("Liquid rescale"));
+          render_success = render_stripes (&image_vals, &drawable_vals, &vals);
+          progress_run_end ();
+        }
+      else if (run_render)
         {
           CarverData * carver_data;
 
           render_success = FALSE;
+          /* the whole rendering is shown as a single progress bar */
+          progress_run_start (_("Liquid rescale"));
           carver_data = render_init_carver (&image_vals, &drawable_vals, &vals, FALSE);
           if (carver_data)
             {
@@ -430,12 +534,13 @@ run (const gchar * name,
                 }
               render_success = render_noninteractive (&vals, &col_vals, carver_data);
             }
+          progress_run_end ();
         }
 
       if (run_mode != GIMP_RUN_NONINTERACTIVE)
         gimp_displays_flush ();
 
-      if ((run_mode == GIMP_RUN_INTERACTIVE) && render_success)
+      if ((run_mode == GIMP_RUN_INTERACTIVE) && render_success && !apply_vmap)
         {
           save_vals();
         }
@@ -444,6 +549,9 @@ run (const gchar * name,
       gimp_image_undo_group_end (image_ID);
     }
 
+  scratch_free_all ();
+  scratch_set_dir (NULL);
+
   values[0].type = GIMP_PDB_STATUS;
   values[0].data.d_status = status;
 
@@ -516,14 +624,15 @@ retrieve_vals_use_aux_layers_names (gint32 image_ID)
   vals.rigmask_layer_ID = layer_from_name(image_ID, vals.rigmask_layer_name);
 }
 
-static void
-noninteractive_read_vals (const GimpParam * param)
+static gboolean
+noninteractive_read_vals (const GimpParam * param, gint n_params)
 {
   gint32 image_ID;
   gint32 aux_pres_layer_ID;
   gint32 aux_disc_layer_ID;
   gint32 aux_rigmask_layer_ID;
   gint32 aux_selected_layer_ID;
+  gint num_targets;
   int val_ind = 3;
 
   image_ID = image_vals.image_ID;
@@ -552,6 +661,33 @@ noninteractive_read_vals (const GimpParam * param)
   g_strlcpy(vals.disc_layer_name, param[val_ind++].data.d_string, VALS_MAX_NAME_LENGTH);
   g_strlcpy(vals.rigmask_layer_name, param[val_ind++].data.d_string, VALS_MAX_NAME_LENGTH);
   g_strlcpy(vals.selected_layer_name, param[val_ind++].data.d_string, VALS_MAX_NAME_LENGTH);
+  if (n_params > LEGACY_ARGS_NUM)
+    {
+      g_strlcpy(vals.output_file, param[val_ind++].data.d_string, VALS_MAX_NAME_LENGTH);
+      vals.pres_from_alpha = param[val_ind++].data.d_int32;
+      vals.seam_cache = param[val_ind++].data.d_int32;
+      vals.seam_parasite = param[val_ind++].data.d_int32;
+      vals.other_layers = param[val_ind++].data.d_int32;
+      g_strlcpy(vals.group_driver_name, param[val_ind++].data.d_string, VALS_MAX_NAME_LENGTH);
+      /* the array comes with its length, as width, height pairs */
+      num_targets = param[val_ind++].data.d_int32;
+      if ((num_targets < 0) || (num_targets % 2 != 0) ||
+          (num_targets > 2 * VALS_MAX_TARGETS) ||
+          ((num_targets > 0) && (param[val_ind].data.d_int32array == NULL)))
+        {
+          return FALSE;
+        }
+      vals.n_targets = num_targets / 2;
+      if (vals.n_targets > 0)
+        {
+          memcpy (vals.targets, param[val_ind].data.d_int32array,
+                  2 * vals.n_targets * sizeof (gint));
+        }
+      val_ind++;
+      vals.pyramid_factor = MAX (param[val_ind++].data.d_int32, 1);
+      vals.memory_limit = MAX (param[val_ind++].data.d_int32, 0);
+      g_strlcpy(vals.scratch_dir, param[val_ind++].data.d_string, VALS_MAX_NAME_LENGTH);
+    }
 
   aux_pres_layer_ID = layer_from_name(image_ID, vals.pres_layer_name);
   aux_disc_layer_ID = layer_from_name(image_ID, vals.disc_layer_name);
@@ -587,6 +723,8 @@ noninteractive_read_vals (const GimpParam * param)
     {
       ui_vals.rigmask_status = TRUE;
     }
+
+  return TRUE;
 }
 
 static void
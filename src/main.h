@@ -98,12 +98,38 @@ enum _OutputTarget
 {
   OUTPUT_TARGET_SAME_LAYER,
   OUTPUT_TARGET_NEW_LAYER,
-  OUTPUT_TARGET_NEW_IMAGE
+  OUTPUT_TARGET_NEW_IMAGE,
+  OUTPUT_TARGET_FILE            /* noninteractive mode only */
 };
 
 typedef enum _OutputTarget OutputTarget;
 
 
+/* Other layers carved along with the active one */
+
+enum _OtherLayers
+{
+  OTHER_LAYERS_NONE,
+  OTHER_LAYERS_LINKED,
+  OTHER_LAYERS_ALL
+};
+
+typedef enum _OtherLayers OtherLayers;
+
+
+/* Seams output */
+
+enum _SeamsOutput
+{
+  SEAMS_OUTPUT_NONE,
+  SEAMS_OUTPUT_COLOUR,
+  SEAMS_OUTPUT_DEPTH_8,
+  SEAMS_OUTPUT_DEPTH_16
+};
+
+typedef enum _SeamsOutput SeamsOutput;
+
+
 /* Scaleback modes */
 
 enum _ScalebackMode
@@ -22,13 +22,16 @@
 /*  Constants  */
 
 #define PLUG_IN_NAME   "plug-in-lqr"
+#define PLUG_IN_APPLY_VMAP_NAME "plug-in-lqr-apply-vmap"
 
 #define DATA_KEY_VALS    "plug_in_lqr"
 #define DATA_KEY_UI_VALS "plug_in_lqr_ui"
 #define DATA_KEY_COL_VALS "plug_in_lqr_col"
 #define PARASITE_KEY     "plug_in_lqr_options"
+#define PARASITE_VMAP_KEY "plug_in_lqr_vmap"
 
 #define VALS_MAX_NAME_LENGTH (1024)
+#define VALS_MAX_TARGETS (16)
 #define MAX_STRING_SIZE   (2048)
 
 typedef struct
@@ -46,7 +49,7 @@ typedef struct
   gboolean resize_aux_layers;
   gboolean resize_canvas;
   gint32 output_target;
-  gboolean output_seams;
+  gint output_seams;
   gint nrg_func;
   gint res_order;
   gint mask_behavior;
@@ -57,6 +60,17 @@ typedef struct
   gchar disc_layer_name[VALS_MAX_NAME_LENGTH];
   gchar rigmask_layer_name[VALS_MAX_NAME_LENGTH];
   gchar selected_layer_name[VALS_MAX_NAME_LENGTH];
+  gchar output_file[VALS_MAX_NAME_LENGTH];
+  gboolean pres_from_alpha;
+  gboolean seam_cache;
+  gboolean seam_parasite;
+  gint other_layers;
+  gchar group_driver_name[VALS_MAX_NAME_LENGTH];
+  gint n_targets;
+  gint targets[2 * VALS_MAX_TARGETS];
+  gint pyramid_factor;
+  gint memory_limit;
+  gchar scratch_dir[VALS_MAX_NAME_LENGTH];
 } PlugInVals;
 
 #endif /* __MAIN_COMMON_H__ */
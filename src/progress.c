@@ -0,0 +1,162 @@
+/* GIMP LiquidRescale Plug-in
+ * Copyright (C) 2007-2010 Carlo Baldassi (the "Author") <carlobaldassi@gmail.com>.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the Licence, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org.licences/>.
+ */
+
+#include "config.h"
+
+#include <libgimp/gimp.h>
+
+#include "progress.h"
+
+/* Share of the progress bar taken by each stage */
+static const gdouble stage_weight[PROGRESS_N_STAGES] = {
+  0.15,                         /* read */
+  0.05,                         /* bias */
+  0.55,                         /* carve */
+  0.20,                         /* write */
+  0.05                          /* aux write */
+};
+
+static struct
+{
+  gboolean running;
+  ProgressStage stage;
+  gdouble base;
+  gint n_tasks;
+  gint task;
+  gchar *text;
+  gdouble last_value;
+  gint64 last_time;
+} state = { FALSE, PROGRESS_STAGE_READ, 0, 1, 0, NULL, 0, 0 };
+
+/* static functions declarations */
+
+static void progress_emit (gdouble value, gboolean force);
+
+
+void
+progress_run_start (const gchar * message)
+{
+  state.running = TRUE;
+  state.stage = PROGRESS_STAGE_READ;
+  state.base = 0;
+  state.n_tasks = 1;
+  state.task = 0;
+  state.text = g_strdup (message);
+  state.last_value = 0;
+  state.last_time = 0;
+  gimp_progress_init (message);
+}
+
+void
+progress_run_end (void)
+{
+  if (!state.running)
+    {
+      return;
+    }
+  progress_emit (1, TRUE);
+  gimp_progress_end ();
+  g_free (state.text);
+  state.text = NULL;
+  state.running = FALSE;
+}
+
+/* Enters a stage, which is expected to be made of n_tasks tasks;
+ * stages which are skipped leave their share empty */
+void
+progress_stage (ProgressStage stage, gint n_tasks)
+{
+  ProgressStage i;
+
+  if (!state.running)
+    {
+      return;
+    }
+  state.stage = stage;
+  state.base = 0;
+  for (i = 0; i < stage; i++)
+    {
+      state.base += stage_weight[i];
+    }
+  state.n_tasks = MAX (n_tasks, 1);
+  state.task = 0;
+  progress_emit (state.base, FALSE);
+}
+
+void
+progress_task_start (const gchar * message)
+{
+  if (!state.running)
+    {
+      gimp_progress_init (message);
+      state.last_value = 0;
+      state.last_time = 0;
+      return;
+    }
+  if ((message != NULL) && (g_strcmp0 (message, state.text) != 0))
+    {
+      g_free (state.text);
+      state.text = g_strdup (message);
+      gimp_progress_set_text (message);
+    }
+}
+
+void
+progress_task_update (gdouble fraction)
+{
+  gdouble done;
+
+  fraction = CLAMP (fraction, 0, 1);
+  if (!state.running)
+    {
+      progress_emit (fraction, FALSE);
+      return;
+    }
+  done = MIN ((state.task + fraction) / state.n_tasks, 1);
+  progress_emit (state.base + stage_weight[state.stage] * done, FALSE);
+}
+
+void
+progress_task_end (void)
+{
+  if (!state.running)
+    {
+      gimp_progress_end ();
+      return;
+    }
+  state.task++;
+}
+
+/* Forwards a value to the progress bar, unless it would move it
+ * backwards, or the last update was too recent */
+static void
+progress_emit (gdouble value, gboolean force)
+{
+  gint64 now;
+
+  now = g_get_monotonic_time ();
+  if (!force &&
+      ((value <= state.last_value) ||
+       (now - state.last_time < PROGRESS_MIN_INTERVAL)))
+    {
+      return;
+    }
+  gimp_progress_update (value);
+  state.last_value = value;
+  state.last_time = now;
+}
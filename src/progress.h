@@ -0,0 +1,49 @@
+/* GIMP LiquidRescale Plug-in
+ * Copyright (C) 2007-2010 Carlo Baldassi (the "Author") <carlobaldassi@gmail.com>.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the Licence, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org.licences/>.
+ */
+
+#ifndef __PROGRESS_H__
+#define __PROGRESS_H__
+
+/* Minimum time between two updates of the progress bar, in microseconds */
+#define PROGRESS_MIN_INTERVAL (100000)
+
+/* The stages of a run, in the order in which they take place;
+ * each one takes a fixed share of the progress bar */
+
+typedef enum
+{
+  PROGRESS_STAGE_READ,
+  PROGRESS_STAGE_BIAS,
+  PROGRESS_STAGE_CARVE,
+  PROGRESS_STAGE_WRITE,
+  PROGRESS_STAGE_AUX_WRITE,
+  PROGRESS_N_STAGES
+} ProgressStage;
+
+/* A run shows a single progress bar, made of stages, which are in
+ * turn made of tasks. Outside of a run, each task gets its own bar */
+
+void progress_run_start (const gchar * message);
+void progress_run_end (void);
+void progress_stage (ProgressStage stage, gint n_tasks);
+
+void progress_task_start (const gchar * message);
+void progress_task_update (gdouble fraction);
+void progress_task_end (void);
+
+#endif /* __PROGRESS_H__ */
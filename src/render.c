@@ -24,8 +24,12 @@
 
 #include <lqr.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "io_functions.h"
+#include "progress.h"
+#include "scratch.h"
+#include "seam_cache.h"
 
 #include "plugin-intl.h"
 
@@ -46,7 +50,7 @@
 #define MEM_CHECK2(x) if ((x) == FALSE) { g_message(_("Not enough memory")); return FALSE; }
 
 #define BPP_CHECK(layer_ID, carver) G_STMT_START { \
-  if (gimp_drawable_bpp(layer_ID) != lqr_carver_get_channels(carver)) \
+  if (layer_channels(layer_ID) != lqr_carver_get_channels(carver)) \
     { \
       g_message(_("Error: number of colour channels changed")); \
       return FALSE; \
@@ -84,18 +88,62 @@
     } \
   } G_STMT_END
 
+/* Rough number of bytes which liblqr allocates for each pixel of a
+ * carver, besides the pixels themselves (energy, bias, cumulative
+ * energy, visibility and coordinates maps) */
+#define CARVER_BYTES_PER_PIXEL (40)
+
+/* Same, for the carvers attached to another one, which only keep
+ * their own visibility and coordinates maps */
+#define ATTACHED_BYTES_PER_PIXEL (8)
+
+/* Bias which draws the seams of a stripe into the pixels carved
+ * from the last line of the previous one */
+#define STRIPE_STITCH_BIAS (1e5)
+
 
 /* static functions declarations */
 
+static gboolean my_progress_init (const gchar * message);
+static gboolean my_progress_update (gdouble fraction);
 static gboolean my_progress_end (const gchar * message);
 static LqrProgress * progress_init (void);
 static gfloat rigidity_init (PlugInVals * vals);
 static gboolean compute_ignore_disc_mask (PlugInVals * vals, gint old_width, gint old_height, gint new_width, gint new_height);
 static void set_tiles (gint width);
+static gboolean vmap_load_usable (PlugInVals * vals, gint old_width, gint old_height);
+static gboolean seam_cache_usable (PlugInVals * vals, gint old_width, gint old_height);
+static LqrRetVal pyramid_vmap (PlugInVals * vals, gint32 image_ID, gint32 layer_ID,
+                               gconstpointer pixels, gint channels, LqrColDepth col_depth,
+                               gint old_width, gint old_height, gint x_off, gint y_off,
+                               gint orientation, gint depth, gfloat rigidity, LqrVMap ** vmap);
+static gint32 pyramid_scaled_copy (gint32 image_ID, gint32 layer_ID, gint width, gint height,
+                                   gint x_off, gint y_off, gint w, gint h);
+static gint stripe_lines (PlugInVals * vals, gint32 layer_ID, gint len);
+static LqrRetVal render_stripe (PlugInVals * vals, LqrProgress * progress,
+                                gint32 source_ID, gint32 target_ID,
+                                gint sx, gint sy, gint sw, gint sh,
+                                gint x_off, gint y_off, gint orientation,
+                                gint depth, gfloat rigidity,
+                                gint * carved, gint * n_carved, gboolean last);
+static gint64 estimate_peak_memory (gint32 image_ID, gint32 layer_ID, PlugInVals * vals);
+static gint resize_steps (gint old_size, gint new_size, gfloat enl_step);
+static gint targets_depth (PlugInVals * vals, gint old_width, gint old_height, gint orientation);
+static gboolean targets_single_direction (PlugInVals * vals, gint old_width, gint old_height);
+static gboolean render_extra_targets (PlugInVals * vals, CarverData * carver_data, gint old_width, gint old_height);
+static gboolean write_extra_target (PlugInVals * vals, CarverData * carver_data, gint width, gint height);
+static gchar * target_file_name (const gchar * filename, gint width, gint height);
 static gboolean check_aux_layer_bpp (LqrCarverList ** carver_list_p, gint32 layer_ID);
 static gboolean copy_aux_layer_to_new_image (gint32 image_ID, gint32 * layer_ID, gint x_off, gint y_off);
 static gboolean resize_unlock_aux_layer (gint32 layer_ID, gint width, gint height, gint x_off, gint y_off);
-static LqrCarver* attach_aux_carver (LqrCarver * carver, gint32 layer_ID, gint width, gint height);
+static LqrCarver* attach_aux_carver (LqrCarver * carver, gint32 layer_ID, gint width, gint height, GHashTable * layer_cache);
+static gint32 * other_layers_collect (gint32 image_ID, gint32 layer_ID, PlugInVals * vals, gint * n_layers);
+static gint group_layers_collect (gint32 group_ID, PlugInVals * vals, gint32 * layers);
+static gint32 group_layer_find (gint32 group_ID, const gchar * name, gint * pos);
+static gint32 group_layer_nth (gint32 group_ID, gint * pos);
+static LqrCarver* attach_other_carver (LqrCarver * carver, gint32 layer_ID, gint width, gint height);
+static void output_copies_remove (PlugInVals * vals, gint32 image_ID, gint32 display_ID, gint32 layer_ID,
+                                  gint32 group_ID, gint32 * other_layers, gint n_other_layers);
 static gboolean write_aux_carver (LqrCarverList ** carver_list_p, gint32 layer_ID, gint width, gint height);
 static void scale_layer_translated (gint32 layer_ID, gint width, gint height, gint x_off, gint y_off);
 
@@ -113,16 +161,35 @@ render_init_carver (PlugInImageVals * image_vals,
   gint32 layer_ID;
   gchar layer_name[LQR_MAX_NAME_LENGTH];
   gchar new_layer_name[LQR_MAX_NAME_LENGTH];
-  guchar *rgb_buffer;
+  gpointer buffer;
+  LqrColDepth col_depth;
+  GHashTable *layer_cache;
   gboolean alpha_lock;
   gboolean alpha_lock_pres = FALSE, alpha_lock_disc = FALSE, alpha_lock_rigmask = FALSE;
   gfloat rigidity;
   gint old_width, old_height;
   gint new_width, new_height;
-  gint bpp;
+  gint channels;
   gint x_off, y_off;
   gboolean ignore_disc_mask = FALSE;
   LqrProgress *progress;
+  CarverSetup *setup;
+  GChecksum *checksum;
+  LqrVMap *vmap;
+  gchar *seam_cache_key = NULL;
+  gboolean seam_cache_hit = FALSE;
+  gboolean use_pyramid;
+  gint32 source_layer_ID;
+  gint32 *other_layers = NULL;
+  gboolean *other_alpha_locks = NULL;
+  gint n_other_layers = 0;
+  gint32 group_ID = 0;
+  gint32 display_ID = -1;
+  gint driver_pos = -1;
+  gint orientation;
+  gint position;
+  gint i;
+  gint64 peak;
 #ifdef __CLOCK_IT__
   double clock1, clock2;
 #endif /* __CLOCK_IT__ */
@@ -142,33 +209,148 @@ render_init_carver (PlugInImageVals * image_vals,
   LAYER_CHECK0 (vals->disc_layer_ID, NULL);
   LAYER_CHECK0 (vals->rigmask_layer_ID, NULL);
 
+  /* the extra target sizes are checked before anything is touched */
+  if (!interactive)
+    {
+      for (i = 0; i < vals->n_targets; i++)
+        {
+          if ((vals->targets[2 * i] <= 0) || (vals->targets[2 * i + 1] <= 0))
+            {
+              g_message (_("Error: invalid target size"));
+              return NULL;
+            }
+        }
+      if ((vals->n_targets > 0) &&
+          !targets_single_direction (vals, gimp_drawable_width (layer_ID),
+                                     gimp_drawable_height (layer_ID)))
+        {
+          g_message (_("Error: the extra target sizes, and the new size, "
+                       "must all reduce the same single dimension"));
+          return NULL;
+        }
+    }
+
+  /* a job which would not fit is refused before anything is touched */
+  if ((!interactive) && (vals->memory_limit > 0))
+    {
+      peak = estimate_peak_memory (image_ID, layer_ID, vals);
+      if (peak > ((gint64) vals->memory_limit << 20))
+        {
+          g_message (_("Error: the rescaling would take about %d MiB of memory, "
+                       "over the limit of %d MiB"),
+                     (gint) ((peak >> 20) + 1), vals->memory_limit);
+          return NULL;
+        }
+    }
+
   UNFLOAT (layer_ID);
   SELECTION_SAVE (image_ID);
   UNMASK (layer_ID);
 
+  /* the layer the seams are computed on, before any copy */
+  source_layer_ID = layer_ID;
+
   g_snprintf (layer_name, LQR_MAX_NAME_LENGTH, "%s",
             gimp_drawable_get_name (layer_ID));
 
   old_width = gimp_drawable_width (layer_ID);
   old_height = gimp_drawable_height (layer_ID);
   gimp_drawable_offsets (layer_ID, &x_off, &y_off);
-  bpp = gimp_drawable_bpp (layer_ID);
+  channels = layer_channels (layer_ID);
 
   new_width = vals->new_width;
   new_height = vals->new_height;
   rigidity = rigidity_init(vals);
 
+  if ((!interactive) && (vals->output_target == OUTPUT_TARGET_FILE))
+    {
+      /* the layer keeps its size, and the carved pixels go to the
+       * file instead; the image has been prepared as above, though */
+      if (vals->output_file[0] == '\0')
+        {
+          g_message (_("Error: no output file given"));
+          return NULL;
+        }
+      if (vals->scaleback && (vals->scaleback_mode != SCALEBACK_MODE_LQRBACK))
+        {
+          g_message (_("Error: only the LqR scale back mode can be used when writing to a file"));
+          return NULL;
+        }
+      vals->resize_aux_layers = FALSE;
+      vals->other_layers = OTHER_LAYERS_NONE;
+    }
+
+  /* a layer group is carved as a whole: the seams are computed on
+   * its projection, or on a driver child, and removed from all of
+   * its children at once; but only the projection can go to a file */
+  if (gimp_item_is_group (layer_ID))
+    {
+      if (interactive)
+        {
+          g_message (_("Error: layer groups can't be rescaled in interactive mode"));
+          return NULL;
+        }
+      if (vals->output_target == OUTPUT_TARGET_NEW_IMAGE)
+        {
+          g_message (_("Error: layer groups can't be output to a new image"));
+          return NULL;
+        }
+      vals->other_layers = OTHER_LAYERS_NONE;
+
+      /* the driver is found by its place in the group, as GIMP
+       * renames the children of a copy */
+      if ((vals->group_driver_name[0] != '\0') &&
+          (vals->output_target != OUTPUT_TARGET_FILE))
+        {
+          gint32 driver_ID;
+
+          driver_pos = 0;
+          driver_ID = group_layer_find (layer_ID, vals->group_driver_name, &driver_pos);
+          if ((driver_ID == -1) || (driver_ID == vals->pres_layer_ID) ||
+              (driver_ID == vals->disc_layer_ID) ||
+              (driver_ID == vals->rigmask_layer_ID))
+            {
+              g_message (_("Error: the group has no layer named \"%s\""),
+                         vals->group_driver_name);
+              return NULL;
+            }
+        }
+    }
+
   if (!interactive)
     {
       ignore_disc_mask = compute_ignore_disc_mask (vals, old_width, old_height, new_width, new_height);
-      if ((vals->output_seams) && (gimp_image_base_type(image_ID) != GIMP_RGB))
+      if ((vals->output_seams == SEAMS_OUTPUT_COLOUR) &&
+          (gimp_image_base_type(image_ID) != GIMP_RGB))
         {
           gimp_image_convert_rgb (image_ID);
         }
     }
 
+  /* the other layers share the seams of the active one, and
+   * follow it to the output target */
+  if ((!interactive) && (vals->other_layers != OTHER_LAYERS_NONE))
+    {
+      other_layers = other_layers_collect (image_ID, layer_ID, vals, &n_other_layers);
+      for (i = 0; i < n_other_layers; i++)
+        {
+          UNFLOAT (other_layers[i]);
+          UNMASK (other_layers[i]);
+        }
+    }
+
   if (vals->output_target == OUTPUT_TARGET_NEW_LAYER)
     {
+      for (i = 0; i < n_other_layers; i++)
+        {
+          /* each copy goes right above its original */
+          position = gimp_image_get_item_position (image_ID, other_layers[i]);
+          g_snprintf (new_layer_name, LQR_MAX_NAME_LENGTH, "%s LqR",
+                      gimp_drawable_get_name (other_layers[i]));
+          other_layers[i] = gimp_layer_copy (other_layers[i]);
+          gimp_image_insert_layer (image_ID, other_layers[i], 0, position);
+          gimp_drawable_set_name (other_layers[i], new_layer_name);
+        }
       g_snprintf (new_layer_name, LQR_MAX_NAME_LENGTH, "%s LqR", layer_name);
       layer_ID = gimp_layer_copy (layer_ID);
       gimp_image_insert_layer (image_ID, layer_ID, 0, -1);
@@ -183,6 +365,11 @@ render_init_carver (PlugInImageVals * image_vals,
       gimp_image_insert_layer (image_ID, layer_ID, 0, -1);
       gimp_layer_translate(layer_ID, -x_off, -y_off);
       gimp_drawable_set_visible (layer_ID, TRUE);
+      /* bottom first, so that their stacking order is kept */
+      for (i = n_other_layers - 1; i >= 0; i--)
+        {
+          copy_aux_layer_to_new_image (image_ID, &other_layers[i], x_off, y_off);
+        }
       if (vals->resize_aux_layers)
         {
           copy_aux_layer_to_new_image (image_ID, &vals->pres_layer_ID, x_off, y_off);
@@ -191,13 +378,69 @@ render_init_carver (PlugInImageVals * image_vals,
           x_off = 0;
           y_off = 0;
         }
-      gimp_display_new(image_ID);
+      display_ID = gimp_display_new(image_ID);
       gimp_image_undo_group_end(image_ID);
     }
 
-  /* unset lock alpha */
-  alpha_lock = gimp_layer_get_lock_alpha (layer_ID);
-  gimp_layer_set_lock_alpha (layer_ID, FALSE);
+  if (gimp_item_is_group (layer_ID) && (vals->output_target != OUTPUT_TARGET_FILE))
+    {
+      group_ID = layer_ID;
+      n_other_layers = group_layers_collect (group_ID, vals, NULL);
+      other_layers = g_new (gint32, MAX (n_other_layers, 1));
+      group_layers_collect (group_ID, vals, other_layers);
+      for (i = 0; i < n_other_layers; i++)
+        {
+          UNMASK (other_layers[i]);
+          /* the children are all brought to the bounds of the
+           * group below, which leaves no gaps only with alpha */
+          if (!gimp_drawable_has_alpha (other_layers[i]))
+            {
+              gimp_layer_add_alpha (other_layers[i]);
+            }
+        }
+
+      if (driver_pos >= 0)
+        {
+          gint driver_x_off, driver_y_off;
+          gint32 driver_ID;
+
+          driver_ID = group_layer_nth (group_ID, &driver_pos);
+          for (i = 0; i < n_other_layers; i++)
+            {
+              if (other_layers[i] == driver_ID)
+                {
+                  break;
+                }
+            }
+          if (i == n_other_layers)
+            {
+              g_message (_("Error: the group has no layer named \"%s\""),
+                         vals->group_driver_name);
+              g_free (other_layers);
+              return NULL;
+            }
+
+          /* the driver is carved, and written back, in place of
+           * the projection */
+          layer_ID = other_layers[i];
+          memmove (other_layers + i, other_layers + i + 1,
+                   (n_other_layers - i - 1) * sizeof (gint32));
+          n_other_layers--;
+
+          gimp_drawable_offsets (layer_ID, &driver_x_off, &driver_y_off);
+          gimp_layer_resize (layer_ID, old_width, old_height,
+                             driver_x_off - x_off, driver_y_off - y_off);
+          channels = layer_channels (layer_ID);
+        }
+    }
+
+  /* unset lock alpha (layer groups have none) */
+  alpha_lock = FALSE;
+  if (!gimp_item_is_group (layer_ID))
+    {
+      alpha_lock = gimp_layer_get_lock_alpha (layer_ID);
+      gimp_layer_set_lock_alpha (layer_ID, FALSE);
+    }
 
   if (vals->resize_aux_layers == TRUE)
     {
@@ -206,6 +449,21 @@ render_init_carver (PlugInImageVals * image_vals,
       alpha_lock_rigmask = resize_unlock_aux_layer (vals->rigmask_layer_ID, old_width, old_height, x_off, y_off);
     }
 
+  if (n_other_layers > 0)
+    {
+      gint layer_x_off, layer_y_off;
+
+      /* the other layers are clipped (or extended) to the
+       * bounds of the active layer */
+      gimp_drawable_offsets (layer_ID, &layer_x_off, &layer_y_off);
+      other_alpha_locks = g_new (gboolean, n_other_layers);
+      for (i = 0; i < n_other_layers; i++)
+        {
+          other_alpha_locks[i] = resize_unlock_aux_layer (other_layers[i], old_width, old_height,
+                                                          layer_x_off, layer_y_off);
+        }
+    }
+
   set_tiles (old_width);
 
   progress = progress_init();
@@ -216,21 +474,93 @@ render_init_carver (PlugInImageVals * image_vals,
   printf ("[ begin ]\n");
 #endif /* __CLOCK_IT__ */
 
-  /* lqr carver initialization */
-  rgb_buffer = rgb_buffer_from_layer (layer_ID);
-  MEM_CHECK_N (rgb_buffer);
-  carver = lqr_carver_new (rgb_buffer, old_width, old_height, bpp);
+  /* lqr carver initialization, in the layer's own precision */
+  progress_stage (PROGRESS_STAGE_READ, 1);
+  buffer = native_buffer_from_layer (layer_ID, &col_depth);
+  MEM_CHECK_N (buffer);
+  carver = carver_new_from_buffer (buffer, old_width, old_height, channels, col_depth);
   MEM_CHECK_N (carver);
-  MEM_CHECK1_N (lqr_carver_init (carver, vals->delta_x, rigidity));
-  MEM_CHECK1_N (update_bias
-               (carver, vals->pres_layer_ID, vals->pres_coeff, x_off, y_off));
-  if (!ignore_disc_mask)
+  /* the carver is initialized, and the masks are added to it, on a
+   * worker thread while the mask layers are read here. When the seams
+   * may instead come from the seam cache, a parasite or the pyramid
+   * search, everything they depend on is hashed into the cache key,
+   * and the jobs are held until the lookup is over, since
+   * lqr_vmap_load needs a carver which is not initialized yet: then
+   * nothing overlaps with the reading */
+  checksum = NULL;
+  orientation = (new_height != old_height);
+  use_pyramid = (!interactive) && (n_other_layers == 0) && (vals->pyramid_factor > 1) &&
+    vmap_load_usable (vals, old_width, old_height);
+  if ((!interactive) && (n_other_layers == 0) &&
+      seam_cache_usable (vals, old_width, old_height))
+    {
+      checksum = g_checksum_new (G_CHECKSUM_SHA1);
+      seam_cache_hash_data (checksum, buffer, (gsize) old_width * old_height *
+                            channels * col_depth_size (col_depth));
+      seam_cache_hash_int (checksum, old_width);
+      seam_cache_hash_int (checksum, old_height);
+      seam_cache_hash_int (checksum, channels);
+      seam_cache_hash_int (checksum, col_depth);
+      seam_cache_hash_int (checksum, orientation);
+      seam_cache_hash_int (checksum, vals->nrg_func);
+      seam_cache_hash_int (checksum, vals->delta_x);
+      seam_cache_hash_double (checksum, rigidity);
+      if (use_pyramid)
+        {
+          seam_cache_hash_int (checksum, vals->pyramid_factor);
+        }
+    }
+  setup = carver_setup_start (carver, vals->delta_x, rigidity, checksum, use_pyramid);
+  MEM_CHECK_N (setup);
+  /* the alpha channel comes from the pixels which were just read */
+  if (vals->pres_from_alpha && gimp_drawable_has_alpha (layer_ID))
+    {
+      carver_setup_alpha_bias (setup, buffer, channels, col_depth, vals->pres_coeff);
+    }
+  /* aux layers which will be attached are read only once */
+  layer_cache = NULL;
+  if (vals->resize_aux_layers)
+    {
+      layer_cache = layer_cache_new ();
+    }
+  progress_stage (PROGRESS_STAGE_BIAS, (vals->pres_layer_ID != 0) +
+                  (vals->disc_layer_ID != 0) + (vals->rigmask_layer_ID != 0));
+  carver_setup_bias (setup, vals->pres_layer_ID, vals->pres_coeff,
+                     vals->disc_layer_ID, ignore_disc_mask ? 0 : vals->disc_coeff,
+                     x_off, y_off, layer_cache);
+  carver_setup_rigmask (setup, vals->rigmask_layer_ID, x_off, y_off, layer_cache);
+  vmap = NULL;
+  if (checksum != NULL)
+    {
+      seam_cache_key = g_strdup (g_checksum_get_string (checksum));
+      g_checksum_free (checksum);
+      if (vals->seam_parasite)
+        {
+          vmap = seam_cache_lookup_parasite (source_layer_ID, seam_cache_key,
+                                             old_width, old_height, orientation,
+                                             targets_depth (vals, old_width, old_height,
+                                                            orientation));
+        }
+      if ((vmap == NULL) && vals->seam_cache)
+        {
+          vmap = seam_cache_lookup (seam_cache_key, old_width, old_height, orientation,
+                                    targets_depth (vals, old_width, old_height, orientation));
+        }
+      seam_cache_hit = (vmap != NULL);
+    }
+  if (use_pyramid && (vmap == NULL))
     {
-      MEM_CHECK1_N (update_bias
-                 (carver, vals->disc_layer_ID, -vals->disc_coeff, x_off, y_off));
+      /* on failure, the exact search is left to run */
+      if (pyramid_vmap (vals, image_ID, layer_ID, buffer, channels, col_depth,
+                        old_width, old_height, x_off, y_off, orientation,
+                        targets_depth (vals, old_width, old_height, orientation),
+                        rigidity, &vmap) != LQR_OK)
+        {
+          vmap = NULL;
+        }
     }
-  MEM_CHECK1_N (set_rigmask
-               (carver, vals->rigmask_layer_ID, x_off, y_off));
+  carver_setup_release (setup, vmap);
+  MEM_CHECK1_N (carver_setup_finish (setup));
   lqr_carver_set_energy_function_builtin (carver, vals->nrg_func);
   lqr_carver_set_resize_order (carver, vals->res_order);
   lqr_carver_set_progress (carver, progress);
@@ -242,14 +572,29 @@ render_init_carver (PlugInImageVals * image_vals,
     }
   if (vals->resize_aux_layers)
     {
-      attach_aux_carver (carver, vals->pres_layer_ID, old_width, old_height);
-      attach_aux_carver (carver, vals->disc_layer_ID, old_width, old_height);
-      attach_aux_carver (carver, vals->rigmask_layer_ID, old_width, old_height);
+      attach_aux_carver (carver, vals->pres_layer_ID, old_width, old_height, layer_cache);
+      attach_aux_carver (carver, vals->disc_layer_ID, old_width, old_height, layer_cache);
+      attach_aux_carver (carver, vals->rigmask_layer_ID, old_width, old_height, layer_cache);
+      layer_cache_destroy (layer_cache);
+    }
+  for (i = 0; i < n_other_layers; i++)
+    {
+      if (attach_other_carver (carver, other_layers[i], old_width, old_height) == NULL)
+        {
+          lqr_carver_destroy (carver);
+          scratch_unmap (buffer);
+          output_copies_remove (vals, image_ID, display_ID, layer_ID, group_ID,
+                                other_layers, n_other_layers);
+          g_free (other_layers);
+          g_free (other_alpha_locks);
+          return NULL;
+        }
     }
 
 #ifdef __CLOCK_IT__
   clock2 = (double) clock () / CLOCKS_PER_SEC;
-  printf ("[ read: %g ]\n", clock2 - clock1);
+  printf ("[ read: %g (%g MPix/s) ]\n", clock2 - clock1,
+          (double) old_width * old_height / 1e6 / (clock2 - clock1));
 #endif /* __CLOCK_IT__ */
 
   MEM_CHECK_N(carver_data = calloc(1, sizeof(CarverData)));
@@ -268,6 +613,13 @@ render_init_carver (PlugInImageVals * image_vals,
   carver_data->orientation = 0;
   carver_data->depth = 0;
   carver_data->enl_step = vals->enl_step / 100;
+  carver_data->seam_cache_key = seam_cache_key;
+  carver_data->seam_cache_hit = seam_cache_hit;
+  carver_data->source_layer_ID = source_layer_ID;
+  carver_data->group_ID = group_ID;
+  carver_data->n_other_layers = n_other_layers;
+  carver_data->other_layers = other_layers;
+  carver_data->other_alpha_locks = other_alpha_locks;
 
   return carver_data;
 }
@@ -287,8 +639,13 @@ render_noninteractive (PlugInVals * vals,
   gint old_width, old_height;
   gint new_width, new_height;
   gint sb_width, sb_height;
+  gint n_passes;
   gint x_off, y_off;
   GimpRGB colour_start, colour_end;
+  LqrVMap *vmap;
+  LqrRetVal ret;
+  gint depth;
+  gint i;
 #ifdef __CLOCK_IT__
   double clock1, clock2, clock3;
 #endif /* __CLOCK_IT__ */
@@ -315,8 +672,51 @@ render_noninteractive (PlugInVals * vals,
   clock1 = (double) clock () / CLOCKS_PER_SEC;
 #endif /* __CLOCK_IT__ */
 
+  /* liblqr runs one task for each direction which is resized,
+   * twice if scaling back */
+  n_passes = (new_width != old_width) + (new_height != old_height);
+  if (vals->scaleback && (vals->scaleback_mode == SCALEBACK_MODE_LQRBACK))
+    {
+      n_passes *= 2;
+    }
+  progress_stage (PROGRESS_STAGE_CARVE, n_passes + vals->n_targets);
+
+  if ((vals->n_targets > 0) &&
+      !render_extra_targets (vals, carver_data, old_width, old_height))
+    {
+      return FALSE;
+    }
+
   MEM_CHECK1 (lqr_carver_resize (carver, new_width, new_height));
 
+  /* the seams just found are kept for later runs; failing
+   * to store them is not an error */
+  if (carver_data->seam_cache_key != NULL)
+    {
+      if (!carver_data->seam_cache_hit)
+        {
+          vmap = lqr_vmap_dump (carver);
+          if (vmap != NULL)
+            {
+              if (vals->seam_cache)
+                {
+                  seam_cache_store (carver_data->seam_cache_key, vmap);
+                }
+              /* the pixels of the source layer are about to be
+               * replaced when it is the target itself */
+              if (vals->seam_parasite &&
+                  (vals->output_target != OUTPUT_TARGET_SAME_LAYER))
+                {
+                  seam_cache_store_parasite (carver_data->source_layer_ID,
+                                             carver_data->seam_cache_key, vmap);
+                }
+              lqr_vmap_destroy (vmap);
+            }
+        }
+      g_free (carver_data->seam_cache_key);
+      carver_data->seam_cache_key = NULL;
+    }
+
   if (vals->scaleback)
     {
       switch (vals->scaleback_mode)
@@ -337,20 +737,63 @@ render_noninteractive (PlugInVals * vals,
         }
     }
 
-  if (vals->output_seams) {
+  progress_stage (PROGRESS_STAGE_WRITE, 1 + (vals->output_seams ? n_passes : 0));
+
+  if (vals->output_seams == SEAMS_OUTPUT_COLOUR) {
     gimp_rgba_set (&colour_start, col_vals->r1, col_vals->g1, col_vals->b1, 1);
     gimp_rgba_set (&colour_end, col_vals->r2, col_vals->g2, col_vals->b2, 1);
 
     MEM_CHECK1 (write_all_vmaps (lqr_vmap_list_start (carver), image_ID, layer_name, x_off,
                      y_off, colour_start, colour_end));
   }
+  else if (vals->output_seams != SEAMS_OUTPUT_NONE) {
+    MEM_CHECK1 (write_all_depth_maps (lqr_vmap_list_start (carver), layer_name,
+                                      vals->output_seams == SEAMS_OUTPUT_DEPTH_16));
+  }
+
+  /* a map whose seams can't be told apart is useless to apply-vmap */
+  depth = vmap_list_max_depth (lqr_vmap_list_start (carver));
+  if (((vals->output_seams == SEAMS_OUTPUT_COLOUR) &&
+       (depth > VMAP_COLOUR_MAX_DEPTH)) ||
+      ((vals->output_seams == SEAMS_OUTPUT_DEPTH_8) &&
+       (depth > VMAP_DEPTH8_MAX_DEPTH)))
+    {
+#ifdef HAVE_GIMP_2_10
+      g_message (_("Warning: the seam map holds %d seams, too many to be told "
+                   "apart in this kind of map, so it can't be applied again; "
+                   "use a 16 bit depth map for that"), depth);
+#else
+      g_message (_("Warning: the seam map holds %d seams, too many to be told "
+                   "apart in this kind of map, so it can't be applied again"),
+                 depth);
+#endif /* HAVE_GIMP_2_10 */
+    }
+
+  if (vals->output_target == OUTPUT_TARGET_FILE)
+    {
+      /* rows are encoded as the carver yields them, without
+       * going through the layer */
+      ret = write_carver_to_file (carver, layer_ID, vals->output_file);
+      lqr_carver_destroy (carver);
+      MEM_CHECK1 (ret);
+      if (!gimp_item_is_group (layer_ID))
+        {
+          gimp_layer_set_lock_alpha (layer_ID, alpha_lock);
+        }
+      return (ret == LQR_OK);
+    }
 
+  /* a layer group follows its children, which are written below
+   * along with the other layers */
   if (vals->resize_canvas)
     {
       gimp_image_resize (image_ID, new_width, new_height, -x_off, -y_off);
-      gimp_layer_resize_to_image_size (layer_ID);
+      if (!gimp_item_is_group (layer_ID))
+        {
+          gimp_layer_resize_to_image_size (layer_ID);
+        }
     }
-  else
+  else if (!gimp_item_is_group (layer_ID))
     {
       gimp_layer_resize (layer_ID, new_width, new_height, 0, 0);
     }
@@ -363,15 +806,31 @@ render_noninteractive (PlugInVals * vals,
 
   set_tiles (new_width);
 
-  MEM_CHECK1 (write_carver_to_layer (carver, layer_ID));
+  if (!gimp_item_is_group (layer_ID))
+    {
+      MEM_CHECK1 (write_carver_to_layer (carver, layer_ID));
+    }
 
+  /* the other layers were attached after the aux layers */
+  carver_list = lqr_carver_list_start (carver);
   if (vals->resize_aux_layers)
     {
-      carver_list = lqr_carver_list_start (carver);
+      progress_stage (PROGRESS_STAGE_AUX_WRITE, (vals->pres_layer_ID != 0) +
+                      (vals->disc_layer_ID != 0) + (vals->rigmask_layer_ID != 0) +
+                      carver_data->n_other_layers);
       MEM_CHECK2 (write_aux_carver (&carver_list, vals->pres_layer_ID, new_width, new_height));
       MEM_CHECK2 (write_aux_carver (&carver_list, vals->disc_layer_ID, new_width, new_height));
       MEM_CHECK2 (write_aux_carver (&carver_list, vals->rigmask_layer_ID, new_width, new_height));
     }
+  else if (carver_data->n_other_layers > 0)
+    {
+      progress_stage (PROGRESS_STAGE_AUX_WRITE, carver_data->n_other_layers);
+    }
+  for (i = 0; i < carver_data->n_other_layers; i++)
+    {
+      MEM_CHECK2 (write_aux_carver (&carver_list, carver_data->other_layers[i],
+                                    new_width, new_height));
+    }
 
   lqr_carver_destroy (carver);
 
@@ -426,6 +885,11 @@ render_noninteractive (PlugInVals * vals,
                   scale_layer_translated (vals->rigmask_layer_ID, sb_width, sb_height, x_off, y_off);
                 }
             }
+          /* scaling a layer group scales its children already */
+          for (i = 0; (i < carver_data->n_other_layers) && !gimp_item_is_group (layer_ID); i++)
+            {
+              scale_layer_translated (carver_data->other_layers[i], sb_width, sb_height, x_off, y_off);
+            }
           break;
         default:
           g_message ("error: unknown mode");
@@ -440,9 +904,16 @@ render_noninteractive (PlugInVals * vals,
 #endif /* __CLOCK_IT__ */
 
   gimp_drawable_set_visible (layer_ID, TRUE);
+  if (carver_data->group_ID)
+    {
+      gimp_drawable_set_visible (carver_data->group_ID, TRUE);
+    }
   gimp_image_set_active_layer (image_ID, layer_ID);
 
-  gimp_layer_set_lock_alpha (layer_ID, alpha_lock);
+  if (!gimp_item_is_group (layer_ID))
+    {
+      gimp_layer_set_lock_alpha (layer_ID, alpha_lock);
+    }
   if (vals->resize_aux_layers == TRUE)
     {
       if (vals->pres_layer_ID != 0)
@@ -458,6 +929,16 @@ render_noninteractive (PlugInVals * vals,
           gimp_layer_set_lock_alpha (vals->rigmask_layer_ID, alpha_lock_rigmask);
         }
     }
+  for (i = 0; i < carver_data->n_other_layers; i++)
+    {
+      gimp_layer_set_lock_alpha (carver_data->other_layers[i],
+                                 carver_data->other_alpha_locks[i]);
+    }
+  g_free (carver_data->other_layers);
+  g_free (carver_data->other_alpha_locks);
+  carver_data->other_layers = NULL;
+  carver_data->other_alpha_locks = NULL;
+  carver_data->n_other_layers = 0;
 
   return TRUE;
 }
@@ -758,88 +1239,1127 @@ render_dump_vmap (PlugInVals * vals,
   return TRUE;
 }
 
-static gboolean
-my_progress_end (const gchar * message)
+/* Resizes a layer along the seams of a map drawn by an earlier run
+ * (see vmap_from_layer), with no energy computation nor seam search,
+ * so that layers of the same size can all be carved alike. The map
+ * must have the size of the layer, and it can only reduce it along
+ * its own direction by up to its depth */
+gboolean
+render_apply_vmap (PlugInImageVals * image_vals,
+        PlugInDrawableVals * drawable_vals,
+        PlugInVals * vals,
+        gint32 vmap_layer_ID)
 {
-  return gimp_progress_end ();
-}
+  LqrCarver *carver;
+  LqrVMap *vmap = NULL;
+  LqrProgress *progress;
+  LqrColDepth col_depth;
+  LqrRetVal ret;
+  gpointer buffer;
+  gint32 image_ID;
+  gint32 layer_ID;
+  gboolean alpha_lock;
+  gint old_width, old_height;
+  gint new_width, new_height;
+  gint x_off, y_off;
+  gint depth;
 
-static LqrProgress*
-progress_init (void)
-{
-  LqrProgress * progress = lqr_progress_new ();
-  MEM_CHECK_N (progress);
-  lqr_progress_set_init (progress, (LqrProgressFuncInit) gimp_progress_init);
-  lqr_progress_set_update (progress, (LqrProgressFuncUpdate) gimp_progress_update);
-  lqr_progress_set_end (progress, (LqrProgressFuncEnd) my_progress_end);
-  lqr_progress_set_init_width_message (progress, _("Resizing width..."));
-  lqr_progress_set_init_height_message (progress,
-                                        _("Resizing height..."));
-  return progress;
-}
+  image_ID = image_vals->image_ID;
+  layer_ID = drawable_vals->layer_ID;
 
-static gfloat
-rigidity_init (PlugInVals * vals)
-{
-  if (vals->rigmask_layer_ID != 0)
-    {
-      return 3 * vals->rigidity;
-    }
-  else
+  IMAGE_CHECK (image_ID, FALSE);
+  LAYER_CHECK (layer_ID, FALSE);
+  LAYER_CHECK (vmap_layer_ID, FALSE);
+
+  /* the map is checked before anything in the image is touched */
+  old_width = gimp_drawable_width (layer_ID);
+  old_height = gimp_drawable_height (layer_ID);
+  gimp_drawable_offsets (layer_ID, &x_off, &y_off);
+
+  new_width = vals->new_width;
+  new_height = vals->new_height;
+
+  if ((gimp_drawable_width (vmap_layer_ID) != old_width) ||
+      (gimp_drawable_height (vmap_layer_ID) != old_height))
     {
-      return vals->rigidity;
+      g_message (_("Error: the seam map and the layer differ in size"));
+      return FALSE;
     }
-}
 
-static gboolean
-compute_ignore_disc_mask (PlugInVals * vals, gint old_width, gint old_height, gint new_width, gint new_height)
-{
-  if (!vals->no_disc_on_enlarge)
+  progress_stage (PROGRESS_STAGE_READ, 2);
+
+  ret = vmap_from_layer (vmap_layer_ID, &vmap);
+  MEM_CHECK1 (ret);
+  if (ret != LQR_OK)
     {
+      g_message (_("Error: the layer does not hold a valid seam map "
+                   "(colour maps of more than %d seams, and 8 bit depth maps "
+                   "of more than %d, can't be read back)"),
+                 VMAP_COLOUR_MAX_DEPTH, VMAP_DEPTH8_MAX_DEPTH);
       return FALSE;
     }
 
-  switch (vals->res_order)
+  depth = lqr_vmap_get_depth (vmap);
+  if (lqr_vmap_get_orientation (vmap) == 0)
     {
-      case LQR_RES_ORDER_HOR:
-        if ((new_width > old_width) || ((new_width == old_width) && (new_height > old_height)))
-          {
-            return TRUE;
-          }
-        break;
-      case LQR_RES_ORDER_VERT:
-        if ((new_height > old_height) || ((new_height == old_height) && (new_width > old_width)))
-          {
-            return TRUE;
-          }
-        break;
-      default:
-        g_message ("Error: unknown resize order index");
-        abort();
+      if ((new_height != old_height) || (new_width > old_width) ||
+          (new_width < old_width - depth))
+        {
+          g_message (_("Error: the seam map can only reduce the width, by up to %d pixels"),
+                     depth);
+          lqr_vmap_destroy (vmap);
+          return FALSE;
+        }
+    }
+  else
+    {
+      if ((new_width != old_width) || (new_height > old_height) ||
+          (new_height < old_height - depth))
+        {
+          g_message (_("Error: the seam map can only reduce the height, by up to %d pixels"),
+                     depth);
+          lqr_vmap_destroy (vmap);
+          return FALSE;
+        }
     }
-  return FALSE;
-}
 
-static void
-set_tiles (gint width)
-{
-  gint ntiles = width / gimp_tile_width () + 1;
-  gimp_tile_cache_size ((gimp_tile_width () * gimp_tile_height () * ntiles *
-                         4 * 2) / 1024 + 1);
-}
+  UNFLOAT (layer_ID);
+  SELECTION_SAVE (image_ID);
+  UNMASK (layer_ID);
 
-static gboolean
-check_aux_layer_bpp (LqrCarverList ** carver_list_p, gint32 layer_ID)
-{
-  LqrCarver * aux_carver;
-  if (!layer_ID)
+  progress = progress_init ();
+  MEM_CHECK (progress);
+
+  buffer = native_buffer_from_layer (layer_ID, &col_depth);
+  MEM_CHECK (buffer);
+  carver = carver_new_from_buffer (buffer, old_width, old_height,
+                                   layer_channels (layer_ID), col_depth);
+  MEM_CHECK (carver);
+  lqr_carver_set_progress (carver, progress);
+
+  /* the carver is not initialized: the map takes the place
+   * of the energy and of the seams */
+  ret = lqr_vmap_load (carver, vmap);
+  lqr_vmap_destroy (vmap);
+  if (ret == LQR_OK)
     {
-      return TRUE;
+      progress_stage (PROGRESS_STAGE_CARVE, 1);
+      ret = lqr_carver_resize (carver, new_width, new_height);
     }
-  aux_carver = lqr_carver_list_current (*carver_list_p);
-  BPP_CHECK (layer_ID, aux_carver);
-  *carver_list_p = lqr_carver_list_next (*carver_list_p);
-  return TRUE;
+  MEM_CHECK1 (ret);
+
+  /* the layer is only resized once the carver holds the result */
+  if (ret != LQR_OK)
+    {
+      lqr_carver_destroy (carver);
+      scratch_unmap (buffer);
+      g_message (_("Error: the seam map could not be applied to the layer"));
+      return FALSE;
+    }
+
+  alpha_lock = gimp_layer_get_lock_alpha (layer_ID);
+  gimp_layer_set_lock_alpha (layer_ID, FALSE);
+
+  progress_stage (PROGRESS_STAGE_WRITE, 1);
+
+  if (vals->resize_canvas)
+    {
+      gimp_image_resize (image_ID, new_width, new_height, -x_off, -y_off);
+      gimp_layer_resize_to_image_size (layer_ID);
+    }
+  else
+    {
+      gimp_layer_resize (layer_ID, new_width, new_height, 0, 0);
+    }
+
+  set_tiles (new_width);
+
+  MEM_CHECK1 (write_carver_to_layer (carver, layer_ID));
+
+  lqr_carver_destroy (carver);
+  scratch_unmap (buffer);
+
+  gimp_layer_set_lock_alpha (layer_ID, alpha_lock);
+
+  return TRUE;
+}
+
+/* Whether the layer is too large to be carved at once within the
+ * memory limit, and can be carved in stripes instead: only plain
+ * reductions in one direction, of a single layer, go in stripes */
+gboolean
+render_stripes_wanted (PlugInImageVals * image_vals,
+        PlugInDrawableVals * drawable_vals,
+        PlugInVals * vals)
+{
+  gint32 layer_ID;
+  gint old_width, old_height;
+
+  if ((vals->memory_limit <= 0) || !gimp_image_is_valid (image_vals->image_ID))
+    {
+      return FALSE;
+    }
+
+  layer_ID = drawable_vals->layer_ID;
+  if (!layer_ID)
+    {
+      layer_ID = gimp_image_get_active_layer (image_vals->image_ID);
+    }
+  if (!gimp_drawable_is_valid (layer_ID) || !gimp_drawable_is_layer (layer_ID) ||
+      gimp_item_is_group (layer_ID))
+    {
+      return FALSE;
+    }
+
+  if (estimate_peak_memory (image_vals->image_ID, layer_ID, vals) <=
+      ((gint64) vals->memory_limit << 20))
+    {
+      return FALSE;
+    }
+
+  old_width = gimp_drawable_width (layer_ID);
+  old_height = gimp_drawable_height (layer_ID);
+
+  if (!((vals->new_width < old_width) && (vals->new_height == old_height)) &&
+      !((vals->new_width == old_width) && (vals->new_height < old_height)))
+    {
+      return FALSE;
+    }
+  if ((vals->output_target == OUTPUT_TARGET_FILE) ||
+      (vals->output_seams != SEAMS_OUTPUT_NONE) || vals->scaleback ||
+      (vals->other_layers != OTHER_LAYERS_NONE) || (vals->n_targets > 0))
+    {
+      return FALSE;
+    }
+  if (vals->resize_aux_layers && (vals->pres_layer_ID || vals->disc_layer_ID ||
+                                  vals->rigmask_layer_ID))
+    {
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Carves the layer in stripes across the seams, each one read,
+ * carved and written back on its own, so that only one stripe is
+ * held in memory at a time. The stripes are stitched together: the
+ * first line of each one is biased towards the pixels carved from
+ * the last line of the previous one, so that the seams run on.
+ * Stripes don't overlap: a stripe can't see the energy of the next
+ * one, so its seams may bend sharply where the stripes meet */
+gboolean
+render_stripes (PlugInImageVals * image_vals,
+        PlugInDrawableVals * drawable_vals,
+        PlugInVals * vals)
+{
+  LqrProgress *progress;
+  LqrColDepth col_depth;
+  LqrRetVal ret = LQR_OK;
+  gpointer buffer;
+  gint32 image_ID;
+  gint32 layer_ID;
+  gint32 source_ID;
+  gint32 target_image_ID;
+  gint32 target_ID;
+  gchar name[LQR_MAX_NAME_LENGTH];
+  gchar *layer_name;
+  gboolean alpha_lock = FALSE;
+  gfloat rigidity;
+  gint old_width, old_height;
+  gint new_width, new_height;
+  gint x_off, y_off;
+  gint orientation, n_lines, depth;
+  gint stripe, n_stripes, lines;
+  gint sx, sy, sw, sh;
+  gint *carved;
+  gint n_carved;
+
+  image_ID = image_vals->image_ID;
+  layer_ID = drawable_vals->layer_ID;
+
+  IMAGE_CHECK (image_ID, FALSE);
+
+  if (!layer_ID)
+    {
+      layer_ID = gimp_image_get_active_layer (image_ID);
+    }
+
+  LAYER_CHECK (layer_ID, FALSE);
+  LAYER_CHECK0 (vals->pres_layer_ID, FALSE);
+  LAYER_CHECK0 (vals->disc_layer_ID, FALSE);
+  LAYER_CHECK0 (vals->rigmask_layer_ID, FALSE);
+
+  UNFLOAT (layer_ID);
+  SELECTION_SAVE (image_ID);
+  UNMASK (layer_ID);
+
+  old_width = gimp_drawable_width (layer_ID);
+  old_height = gimp_drawable_height (layer_ID);
+  gimp_drawable_offsets (layer_ID, &x_off, &y_off);
+
+  new_width = vals->new_width;
+  new_height = vals->new_height;
+  rigidity = rigidity_init (vals);
+
+  /* the lines are the rows for vertical seams, and the stripes
+   * are made of whole lines */
+  orientation = (new_height != old_height);
+  n_lines = orientation ? old_width : old_height;
+  depth = orientation ? old_height - new_height : old_width - new_width;
+
+  lines = stripe_lines (vals, layer_ID, orientation ? old_height : old_width);
+  if (lines < 2)
+    {
+      g_message (_("Error: the memory limit is too low for the layer to be carved"));
+      return FALSE;
+    }
+  n_stripes = (n_lines + lines - 1) / lines;
+  lines = (n_lines + n_stripes - 1) / n_stripes;
+
+  progress = progress_init ();
+  MEM_CHECK (progress);
+  MEM_CHECK (carved = g_try_new (gint, depth));
+  n_carved = 0;
+
+  /* the pixels are read from the layer, or from a copy of it
+   * when the result takes its place */
+  layer_name = gimp_drawable_get_name (layer_ID);
+  g_snprintf (name, LQR_MAX_NAME_LENGTH, "%s LqR", layer_name);
+  g_free (layer_name);
+
+  source_ID = layer_ID;
+  target_image_ID = image_ID;
+  switch (vals->output_target)
+    {
+    case OUTPUT_TARGET_NEW_LAYER:
+      target_ID = gimp_layer_new (image_ID, name, new_width, new_height,
+                                  gimp_drawable_type (layer_ID),
+                                  gimp_layer_get_opacity (layer_ID),
+                                  gimp_layer_get_mode (layer_ID));
+      gimp_image_insert_layer (image_ID, target_ID, 0, -1);
+      gimp_layer_set_offsets (target_ID, x_off, y_off);
+      break;
+
+    case OUTPUT_TARGET_NEW_IMAGE:
+#ifdef HAVE_GIMP_2_10
+      target_image_ID = gimp_image_new_with_precision (new_width, new_height,
+                                                       gimp_image_base_type (image_ID),
+                                                       gimp_image_get_precision (image_ID));
+#else
+      target_image_ID = gimp_image_new (new_width, new_height, gimp_image_base_type (image_ID));
+#endif /* HAVE_GIMP_2_10 */
+      gimp_image_undo_disable (target_image_ID);
+      target_ID = gimp_layer_new (target_image_ID, name, new_width, new_height,
+                                  gimp_drawable_type (layer_ID), 100,
+                                  GIMP_NORMAL_MODE);
+      gimp_image_insert_layer (target_image_ID, target_ID, 0, -1);
+      break;
+
+    default:
+      source_ID = gimp_layer_new_from_drawable (layer_ID, image_ID);
+      gimp_image_insert_layer (image_ID, source_ID, 0, -1);
+      gimp_drawable_set_visible (source_ID, FALSE);
+      target_ID = layer_ID;
+      alpha_lock = gimp_layer_get_lock_alpha (target_ID);
+      gimp_layer_set_lock_alpha (target_ID, FALSE);
+      /* the stripes are then written straight into the layer, which
+       * is undone along with the resize */
+      gimp_layer_resize (target_ID, new_width, new_height, 0, 0);
+      break;
+    }
+
+  /* each stripe is read, carved and written */
+  progress_stage (PROGRESS_STAGE_CARVE, 3 * n_stripes);
+
+  for (stripe = 0; (stripe < n_stripes) && (ret == LQR_OK); stripe++)
+    {
+      sx = orientation ? stripe * lines : 0;
+      sy = orientation ? 0 : stripe * lines;
+      sw = orientation ? MIN (lines, n_lines - sx) : old_width;
+      sh = orientation ? old_height : MIN (lines, n_lines - sy);
+
+      ret = render_stripe (vals, progress, source_ID, target_ID,
+                           sx, sy, sw, sh, x_off, y_off, orientation,
+                           depth, rigidity, carved, &n_carved,
+                           stripe == n_stripes - 1);
+    }
+
+  g_free (carved);
+
+  /* on failure, the output is dropped, or the layer is given back
+   * its size and its pixels */
+  if (ret != LQR_OK)
+    {
+      switch (vals->output_target)
+        {
+        case OUTPUT_TARGET_NEW_LAYER:
+          gimp_image_remove_layer (image_ID, target_ID);
+          break;
+
+        case OUTPUT_TARGET_NEW_IMAGE:
+          gimp_image_delete (target_image_ID);
+          break;
+
+        default:
+          gimp_layer_resize (target_ID, old_width, old_height, 0, 0);
+          for (stripe = 0; stripe < n_stripes; stripe++)
+            {
+              sx = orientation ? stripe * lines : 0;
+              sy = orientation ? 0 : stripe * lines;
+              sw = orientation ? MIN (lines, n_lines - sx) : old_width;
+              sh = orientation ? old_height : MIN (lines, n_lines - sy);
+              buffer = native_buffer_from_layer_area (source_ID, sx, sy, sw, sh,
+                                                      &col_depth);
+              if (buffer == NULL)
+                {
+                  break;
+                }
+              write_buffer_to_layer_area (buffer, col_depth, target_ID,
+                                          sx, sy, sw, sh);
+              scratch_free (buffer);
+            }
+          break;
+        }
+    }
+
+  if (source_ID != layer_ID)
+    {
+      gimp_image_remove_layer (image_ID, source_ID);
+      gimp_layer_set_lock_alpha (target_ID, alpha_lock);
+    }
+
+  if (ret != LQR_OK)
+    {
+      if (ret == LQR_NOMEM)
+        {
+          g_message (_("Not enough memory"));
+        }
+      else
+        {
+          g_message (_("Error: the layer could not be carved in stripes"));
+        }
+      return FALSE;
+    }
+
+  if (vals->output_target == OUTPUT_TARGET_NEW_IMAGE)
+    {
+      gimp_image_undo_enable (target_image_ID);
+      gimp_display_new (target_image_ID);
+    }
+  else if (vals->resize_canvas)
+    {
+      gimp_image_resize (image_ID, new_width, new_height, -x_off, -y_off);
+    }
+
+  return TRUE;
+}
+
+/* liblqr progress goes through the same aggregator as the
+ * plug-in's own stages */
+static gboolean
+my_progress_init (const gchar * message)
+{
+  progress_task_start (message);
+  return TRUE;
+}
+
+static gboolean
+my_progress_update (gdouble fraction)
+{
+  progress_task_update (fraction);
+  return TRUE;
+}
+
+static gboolean
+my_progress_end (const gchar * message)
+{
+  progress_task_end ();
+  return TRUE;
+}
+
+static LqrProgress*
+progress_init (void)
+{
+  LqrProgress * progress = lqr_progress_new ();
+  MEM_CHECK_N (progress);
+  lqr_progress_set_init (progress, (LqrProgressFuncInit) my_progress_init);
+  lqr_progress_set_update (progress, (LqrProgressFuncUpdate) my_progress_update);
+  lqr_progress_set_end (progress, (LqrProgressFuncEnd) my_progress_end);
+  lqr_progress_set_init_width_message (progress, _("Resizing width..."));
+  lqr_progress_set_init_height_message (progress,
+                                        _("Resizing height..."));
+  return progress;
+}
+
+static gfloat
+rigidity_init (PlugInVals * vals)
+{
+  if (vals->rigmask_layer_ID != 0)
+    {
+      return 3 * vals->rigidity;
+    }
+  else
+    {
+      return vals->rigidity;
+    }
+}
+
+static gboolean
+compute_ignore_disc_mask (PlugInVals * vals, gint old_width, gint old_height, gint new_width, gint new_height)
+{
+  if (!vals->no_disc_on_enlarge)
+    {
+      return FALSE;
+    }
+
+  switch (vals->res_order)
+    {
+      case LQR_RES_ORDER_HOR:
+        if ((new_width > old_width) || ((new_width == old_width) && (new_height > old_height)))
+          {
+            return TRUE;
+          }
+        break;
+      case LQR_RES_ORDER_VERT:
+        if ((new_height > old_height) || ((new_height == old_height) && (new_width > old_width)))
+          {
+            return TRUE;
+          }
+        break;
+      default:
+        g_message ("Error: unknown resize order index");
+        abort();
+    }
+  return FALSE;
+}
+
+static void
+set_tiles (gint width)
+{
+  gint ntiles = width / gimp_tile_width () + 1;
+  gimp_tile_cache_size ((gimp_tile_width () * gimp_tile_height () * ntiles *
+                         4 * 2) / 1024 + 1);
+}
+
+/* A visibility map loaded in place of the seam search only holds
+ * the seams for one direction, and can't follow the aux (or other)
+ * layers nor be dumped again as seam maps */
+static gboolean
+vmap_load_usable (PlugInVals * vals, gint old_width, gint old_height)
+{
+  gboolean horizontal, vertical;
+  gint i;
+
+  if (vals->output_seams != SEAMS_OUTPUT_NONE)
+    {
+      return FALSE;
+    }
+  if (vals->scaleback && (vals->scaleback_mode == SCALEBACK_MODE_LQRBACK))
+    {
+      return FALSE;
+    }
+  if (vals->resize_aux_layers && (vals->pres_layer_ID || vals->disc_layer_ID ||
+                                  vals->rigmask_layer_ID))
+    {
+      return FALSE;
+    }
+  if (vals->other_layers != OTHER_LAYERS_NONE)
+    {
+      return FALSE;
+    }
+  horizontal = (vals->new_width < old_width) && (vals->new_height == old_height);
+  vertical = (vals->new_width == old_width) && (vals->new_height < old_height);
+  for (i = 0; i < vals->n_targets; i++)
+    {
+      horizontal = horizontal && (vals->targets[2 * i] <= old_width) &&
+        (vals->targets[2 * i + 1] == old_height);
+      vertical = vertical && (vals->targets[2 * i] == old_width) &&
+        (vals->targets[2 * i + 1] <= old_height);
+    }
+  return horizontal || vertical;
+}
+
+static gboolean
+seam_cache_usable (PlugInVals * vals, gint old_width, gint old_height)
+{
+  if (!vals->seam_cache && !vals->seam_parasite)
+    {
+      return FALSE;
+    }
+  return vmap_load_usable (vals, old_width, old_height);
+}
+
+/* Reads, carves and writes back one stripe of render_stripes. On
+ * input, carved holds the n_carved positions which the previous
+ * stripe carved from its last line; unless this is the last stripe,
+ * they are replaced by those of this one */
+static LqrRetVal
+render_stripe (PlugInVals * vals, LqrProgress * progress,
+               gint32 source_ID, gint32 target_ID,
+               gint sx, gint sy, gint sw, gint sh, gint x_off, gint y_off,
+               gint orientation, gint depth, gfloat rigidity,
+               gint * carved, gint * n_carved, gboolean last)
+{
+  LqrCarver *carver;
+  LqrVMap *vmap;
+  LqrColDepth col_depth;
+  CarverSetup *setup;
+  LqrRetVal ret = LQR_OK;
+  gpointer buffer;
+  const gint *data;
+  gint len;
+  gint k;
+
+  len = orientation ? sh : sw;
+
+  buffer = native_buffer_from_layer_area (source_ID, sx, sy, sw, sh, &col_depth);
+  if (buffer == NULL)
+    {
+      return LQR_NOMEM;
+    }
+  carver = carver_new_from_buffer (buffer, sw, sh, layer_channels (source_ID), col_depth);
+  if (carver == NULL)
+    {
+      scratch_free (buffer);
+      return LQR_NOMEM;
+    }
+
+  setup = carver_setup_start (carver, vals->delta_x, rigidity, NULL, FALSE);
+  if (setup == NULL)
+    {
+      ret = LQR_NOMEM;
+    }
+  else
+    {
+      if (vals->pres_from_alpha && gimp_drawable_has_alpha (source_ID))
+        {
+          carver_setup_alpha_bias (setup, buffer, layer_channels (source_ID),
+                                   col_depth, vals->pres_coeff);
+        }
+      carver_setup_bias (setup, vals->pres_layer_ID, vals->pres_coeff,
+                         vals->disc_layer_ID, vals->disc_coeff,
+                         x_off + sx, y_off + sy, NULL);
+      carver_setup_rigmask (setup, vals->rigmask_layer_ID, x_off + sx, y_off + sy, NULL);
+      ret = carver_setup_finish (setup);
+    }
+
+  for (k = 0; (k < *n_carved) && (ret == LQR_OK); k++)
+    {
+      ret = lqr_carver_bias_add_xy (carver, -STRIPE_STITCH_BIAS,
+                                    orientation ? 0 : carved[k],
+                                    orientation ? carved[k] : 0);
+    }
+
+  if (ret == LQR_OK)
+    {
+      lqr_carver_set_energy_function_builtin (carver, vals->nrg_func);
+      lqr_carver_set_progress (carver, progress);
+      ret = lqr_carver_resize (carver, orientation ? sw : sw - depth,
+                               orientation ? sh - depth : sh);
+    }
+
+  /* the pixels carved from the last line, for the next stripe */
+  if ((ret == LQR_OK) && !last)
+    {
+      vmap = lqr_vmap_dump (carver);
+      if (vmap == NULL)
+        {
+          ret = LQR_NOMEM;
+        }
+      else
+        {
+          data = lqr_vmap_get_data (vmap);
+          *n_carved = 0;
+          for (k = 0; (k < len) && (*n_carved < depth); k++)
+            {
+              if (data[orientation ? (gsize) k * sw + sw - 1 :
+                       (gsize) (sh - 1) * sw + k] != 0)
+                {
+                  carved[(*n_carved)++] = k;
+                }
+            }
+          lqr_vmap_destroy (vmap);
+        }
+    }
+
+  if (ret == LQR_OK)
+    {
+      ret = write_carver_to_layer_area (carver, target_ID, sx, sy);
+    }
+
+  lqr_carver_destroy (carver);
+  scratch_unmap (buffer);
+
+  return ret;
+}
+
+/* Searches the seams of a plain reduction on copies of the layer and
+ * of its masks scaled down by the pyramid factor, and refines them
+ * at full size, where they are only left to be loaded.
+ * *vmap stays NULL if the layer is too small to be scaled down */
+static LqrRetVal
+pyramid_vmap (PlugInVals * vals, gint32 image_ID, gint32 layer_ID,
+              gconstpointer pixels, gint channels, LqrColDepth col_depth,
+              gint old_width, gint old_height, gint x_off, gint y_off,
+              gint orientation, gint depth, gfloat rigidity, LqrVMap ** vmap)
+{
+  LqrCarver *coarse = NULL;
+  LqrVMap *coarse_vmap;
+  CarverSetup *setup;
+  LqrColDepth coarse_col_depth;
+  LqrRetVal ret = LQR_NOMEM;
+  gpointer coarse_buffer;
+  gint32 scaled_image_ID;
+  gint32 copy_ID[4];
+  gint cw, ch;
+  gint len, coarse_len, coarse_depth;
+
+  *vmap = NULL;
+
+  cw = old_width / vals->pyramid_factor;
+  ch = old_height / vals->pyramid_factor;
+  len = orientation ? old_height : old_width;
+  coarse_len = orientation ? ch : cw;
+  if ((cw < 2) || (ch < 2))
+    {
+      return LQR_OK;
+    }
+  coarse_depth = (gint) (((gint64) depth * coarse_len + len - 1) / len);
+  coarse_depth = CLAMP (coarse_depth, 1, coarse_len - 1);
+
+  /* the copies are scaled in an image of their own, which is
+   * never shown, so that the user's image is left alone */
+#ifdef HAVE_GIMP_2_10
+  scaled_image_ID = gimp_image_new_with_precision (cw, ch, gimp_image_base_type (image_ID),
+                                                   gimp_image_get_precision (image_ID));
+#else
+  scaled_image_ID = gimp_image_new (cw, ch, gimp_image_base_type (image_ID));
+#endif /* HAVE_GIMP_2_10 */
+  gimp_image_undo_disable (scaled_image_ID);
+
+  copy_ID[0] = pyramid_scaled_copy (scaled_image_ID, layer_ID, old_width, old_height,
+                                    x_off, y_off, cw, ch);
+  copy_ID[1] = pyramid_scaled_copy (scaled_image_ID, vals->pres_layer_ID, old_width,
+                                    old_height, x_off, y_off, cw, ch);
+  copy_ID[2] = pyramid_scaled_copy (scaled_image_ID, vals->disc_layer_ID, old_width,
+                                    old_height, x_off, y_off, cw, ch);
+  copy_ID[3] = pyramid_scaled_copy (scaled_image_ID, vals->rigmask_layer_ID, old_width,
+                                    old_height, x_off, y_off, cw, ch);
+
+  coarse_buffer = native_buffer_from_layer (copy_ID[0], &coarse_col_depth);
+  if (coarse_buffer != NULL)
+    {
+      coarse = carver_new_from_buffer (coarse_buffer, cw, ch, channels, coarse_col_depth);
+    }
+  if (coarse != NULL)
+    {
+      setup = carver_setup_start (coarse, vals->delta_x, rigidity, NULL, FALSE);
+      if (setup != NULL)
+        {
+          if (vals->pres_from_alpha && gimp_drawable_has_alpha (layer_ID))
+            {
+              carver_setup_alpha_bias (setup, coarse_buffer, channels,
+                                       coarse_col_depth, vals->pres_coeff);
+            }
+          carver_setup_bias (setup, copy_ID[1], vals->pres_coeff,
+                             copy_ID[2], vals->disc_coeff, 0, 0, NULL);
+          carver_setup_rigmask (setup, copy_ID[3], 0, 0, NULL);
+          ret = carver_setup_finish (setup);
+        }
+    }
+  else
+    {
+      scratch_free (coarse_buffer);
+    }
+
+  gimp_image_delete (scaled_image_ID);
+
+  if (ret == LQR_OK)
+    {
+      lqr_carver_set_energy_function_builtin (coarse, vals->nrg_func);
+      ret = lqr_carver_resize (coarse, orientation ? cw : cw - coarse_depth,
+                               orientation ? ch - coarse_depth : ch);
+    }
+  if (ret == LQR_OK)
+    {
+      coarse_vmap = lqr_vmap_dump (coarse);
+      ret = LQR_NOMEM;
+      if (coarse_vmap != NULL)
+        {
+          ret = vmap_project (coarse_vmap, pixels, old_width, old_height,
+                              channels, col_depth, depth, vals->delta_x, vmap);
+          lqr_vmap_destroy (coarse_vmap);
+        }
+    }
+
+  if (coarse != NULL)
+    {
+      lqr_carver_destroy (coarse);
+      scratch_unmap (coarse_buffer);
+    }
+
+  return ret;
+}
+
+/* Number of lines, each len pixels long, which a carver can hold
+ * within the memory limit */
+static gint
+stripe_lines (PlugInVals * vals, gint32 layer_ID, gint len)
+{
+  gint64 limit;
+  gint64 line_bytes;
+
+  limit = (gint64) vals->memory_limit << 20;
+  line_bytes = (gint64) len * (gimp_drawable_bpp (layer_ID) + CARVER_BYTES_PER_PIXEL +
+                               sizeof (gint));
+
+  return (gint) MIN (limit / line_bytes, G_MAXINT);
+}
+
+/* Estimates the peak memory, in bytes, taken by carving the layer:
+ * the carver and the ones attached to it, the masks, the seam maps
+ * which are dumped, and the enlargement steps, during which the
+ * carvers are held at two consecutive sizes at once. The pixels
+ * mapped from files in the scratch directory are left out, as the
+ * limit is meant for the memory which can't be paged out */
+static gint64
+estimate_peak_memory (gint32 image_ID, gint32 layer_ID, PlugInVals * vals)
+{
+  gint64 area, old_area, peak;
+  gint old_width, old_height;
+  gint bpp;
+  gint pixels;
+  gint32 *layers = NULL;
+  gint n_layers = 0;
+  gint n_dumps;
+  gint i;
+
+  old_width = gimp_drawable_width (layer_ID);
+  old_height = gimp_drawable_height (layer_ID);
+  bpp = gimp_drawable_bpp (layer_ID);
+  old_area = (gint64) old_width * old_height;
+  area = (gint64) MAX (old_width, vals->new_width) * MAX (old_height, vals->new_height);
+
+  /* the pixels of the layers stay mapped, unless liblqr copies them
+   * to the heap, as it does on enlarging and on switching direction */
+  pixels = !scratch_enabled () ||
+    (vals->new_width > old_width) || (vals->new_height > old_height) ||
+    ((vals->new_width != old_width) && (vals->new_height != old_height)) ||
+    (vals->scaleback && (vals->scaleback_mode == SCALEBACK_MODE_LQRBACK));
+
+  peak = area * (pixels * bpp + CARVER_BYTES_PER_PIXEL);
+
+  if (vals->resize_aux_layers)
+    {
+      if (vals->pres_layer_ID)
+        {
+          peak += area * (gimp_drawable_bpp (vals->pres_layer_ID) + ATTACHED_BYTES_PER_PIXEL);
+        }
+      if (vals->disc_layer_ID)
+        {
+          peak += area * (gimp_drawable_bpp (vals->disc_layer_ID) + ATTACHED_BYTES_PER_PIXEL);
+        }
+      if (vals->rigmask_layer_ID)
+        {
+          peak += area * (gimp_drawable_bpp (vals->rigmask_layer_ID) + ATTACHED_BYTES_PER_PIXEL);
+        }
+    }
+
+  if (gimp_item_is_group (layer_ID))
+    {
+      n_layers = group_layers_collect (layer_ID, vals, NULL);
+      layers = g_new (gint32, MAX (n_layers, 1));
+      group_layers_collect (layer_ID, vals, layers);
+    }
+  else if ((vals->other_layers != OTHER_LAYERS_NONE) &&
+           (vals->output_target != OUTPUT_TARGET_FILE))
+    {
+      layers = other_layers_collect (image_ID, layer_ID, vals, &n_layers);
+    }
+  for (i = 0; i < n_layers; i++)
+    {
+      peak += area * (pixels * gimp_drawable_bpp (layers[i]) + ATTACHED_BYTES_PER_PIXEL);
+    }
+  g_free (layers);
+
+  /* the masks are read at one byte per pixel */
+  peak += old_area * ((vals->pres_layer_ID != 0) + (vals->disc_layer_ID != 0) +
+                      (vals->rigmask_layer_ID != 0));
+
+  if ((vals->new_width > old_width) || (vals->new_height > old_height))
+    {
+      peak += (gint64) (peak / MAX (vals->enl_step / 100, 1));
+    }
+
+  /* one visibility map is kept for each resize step, and each
+   * is then rasterized in turn */
+  if (vals->output_seams != SEAMS_OUTPUT_NONE)
+    {
+      n_dumps = resize_steps (old_width, vals->new_width, vals->enl_step / 100) +
+        resize_steps (old_height, vals->new_height, vals->enl_step / 100);
+      peak += area * (n_dumps * sizeof (gint) + sizeof (guint32));
+    }
+
+  /* the columns of a carver are gathered whole on their way to a file */
+  if (vals->output_target == OUTPUT_TARGET_FILE)
+    {
+      peak += (gint64) vals->new_width * vals->new_height * bpp;
+    }
+
+  /* the pyramid search adds a small carver, and the projected map
+   * along with the counts of its carved pixels */
+  if (vals->pyramid_factor > 1)
+    {
+      peak += old_area * 2 * sizeof (gint) +
+        old_area / ((gint64) vals->pyramid_factor * vals->pyramid_factor) *
+        (bpp + CARVER_BYTES_PER_PIXEL);
+    }
+
+  return peak;
+}
+
+/* Number of passes which liblqr takes to bring a size to another:
+ * one for a reduction, one per enlargement step otherwise */
+static gint
+resize_steps (gint old_size, gint new_size, gfloat enl_step)
+{
+  gint steps = 0;
+
+  if (new_size == old_size)
+    {
+      return 0;
+    }
+  if ((new_size < old_size) || (enl_step <= 1))
+    {
+      return 1;
+    }
+  while (old_size < new_size)
+    {
+      old_size = MAX ((gint) (old_size * enl_step), old_size + 1);
+      steps++;
+    }
+
+  return steps;
+}
+
+/* A copy of a layer in the given image, brought to the bounds of the
+ * carved one, then scaled down to w x h and moved to the origin; 0
+ * for none */
+static gint32
+pyramid_scaled_copy (gint32 image_ID, gint32 layer_ID, gint width, gint height,
+                     gint x_off, gint y_off, gint w, gint h)
+{
+  gint32 copy_ID;
+  gint layer_x_off, layer_y_off;
+
+  if (layer_ID == 0)
+    {
+      return 0;
+    }
+
+  copy_ID = gimp_layer_new_from_drawable (layer_ID, image_ID);
+  gimp_image_insert_layer (image_ID, copy_ID, 0, -1);
+  gimp_drawable_offsets (layer_ID, &layer_x_off, &layer_y_off);
+  gimp_layer_resize (copy_ID, width, height, layer_x_off - x_off, layer_y_off - y_off);
+  gimp_layer_scale (copy_ID, w, h, TRUE);
+  gimp_layer_set_offsets (copy_ID, 0, 0);
+
+  return copy_ID;
+}
+
+/* Number of seams, in the given direction, needed by the
+ * deepest of the target sizes */
+static gint
+targets_depth (PlugInVals * vals, gint old_width, gint old_height, gint orientation)
+{
+  gint depth;
+  gint i;
+
+  depth = orientation ? old_height - vals->new_height : old_width - vals->new_width;
+  for (i = 0; i < vals->n_targets; i++)
+    {
+      depth = MAX (depth, orientation ? old_height - vals->targets[2 * i + 1] :
+                   old_width - vals->targets[2 * i]);
+    }
+  return depth;
+}
+
+/* liblqr flattens the carver when it switches between width and
+ * height, and inflates it when enlarging, after which the earlier
+ * seams are lost: all the sizes can only come from one visibility
+ * map if they reduce (or keep) the same single dimension */
+static gboolean
+targets_single_direction (PlugInVals * vals, gint old_width, gint old_height)
+{
+  gboolean horizontal, vertical;
+  gint i;
+
+  horizontal = (vals->new_width <= old_width) && (vals->new_height == old_height);
+  vertical = (vals->new_width == old_width) && (vals->new_height <= old_height);
+  for (i = 0; i < vals->n_targets; i++)
+    {
+      horizontal = horizontal && (vals->targets[2 * i] <= old_width) &&
+        (vals->targets[2 * i + 1] == old_height);
+      vertical = vertical && (vals->targets[2 * i] == old_width) &&
+        (vals->targets[2 * i + 1] <= old_height);
+    }
+  return horizontal || vertical;
+}
+
+/* Carves the extra target sizes, each into its own output, ahead of
+ * the main one. The size farthest from the original one is carved
+ * first, so that the seams are searched only once: the others are
+ * then served from the same visibility map, and written from the
+ * smallest change to the largest */
+static gboolean
+render_extra_targets (PlugInVals * vals, CarverData * carver_data, gint old_width, gint old_height)
+{
+  LqrCarver *carver;
+  gint order[VALS_MAX_TARGETS];
+  gint change[VALS_MAX_TARGETS];
+  gint deep_width, deep_height, deep_change;
+  gint width, height;
+  gint i, j, k;
+
+  carver = carver_data->carver;
+
+  deep_width = vals->new_width;
+  deep_height = vals->new_height;
+  deep_change = ABS (deep_width - old_width) + ABS (deep_height - old_height);
+
+  for (i = 0; i < vals->n_targets; i++)
+    {
+      width = vals->targets[2 * i];
+      height = vals->targets[2 * i + 1];
+      change[i] = ABS (width - old_width) + ABS (height - old_height);
+      if (change[i] > deep_change)
+        {
+          deep_width = width;
+          deep_height = height;
+          deep_change = change[i];
+        }
+
+      /* insertion sort, by increasing change */
+      for (j = i; (j > 0) && (change[order[j - 1]] > change[i]); j--)
+        {
+          order[j] = order[j - 1];
+        }
+      order[j] = i;
+    }
+
+  MEM_CHECK1 (lqr_carver_resize (carver, deep_width, deep_height));
+
+  for (i = 0; i < vals->n_targets; i++)
+    {
+      k = order[i];
+      width = vals->targets[2 * k];
+      height = vals->targets[2 * k + 1];
+      MEM_CHECK1 (lqr_carver_resize (carver, width, height));
+      if (!write_extra_target (vals, carver_data, width, height))
+        {
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+/* Writes the carver, at one of the extra target sizes, to a new
+ * layer above the active one, to a new image or to a file, after
+ * the output target */
+static gboolean
+write_extra_target (PlugInVals * vals, CarverData * carver_data, gint width, gint height)
+{
+  gint32 image_ID;
+  gint32 layer_ID;
+  gint32 target_image_ID;
+  gint32 target_layer_ID;
+  gchar name[LQR_MAX_NAME_LENGTH];
+  gchar *layer_name;
+  gchar *filename;
+  gint x_off, y_off;
+  LqrRetVal ret;
+
+  image_ID = carver_data->image_ID;
+  layer_ID = carver_data->layer_ID;
+
+  layer_name = gimp_drawable_get_name (layer_ID);
+  /* (here "%s" represents the selected layer's name, followed
+   * by the target width and height) */
+  g_snprintf (name, LQR_MAX_NAME_LENGTH, _("%s LqR %dx%d"), layer_name, width, height);
+  g_free (layer_name);
+
+  switch (vals->output_target)
+    {
+    case OUTPUT_TARGET_FILE:
+      filename = target_file_name (vals->output_file, width, height);
+      ret = write_carver_to_file (carver_data->carver, layer_ID, filename);
+      g_free (filename);
+      MEM_CHECK1 (ret);
+      return (ret == LQR_OK);
+
+    case OUTPUT_TARGET_NEW_IMAGE:
+#ifdef HAVE_GIMP_2_10
+      target_image_ID = gimp_image_new_with_precision (width, height,
+                                                       gimp_image_base_type (image_ID),
+                                                       gimp_image_get_precision (image_ID));
+#else
+      target_image_ID = gimp_image_new (width, height, gimp_image_base_type (image_ID));
+#endif /* HAVE_GIMP_2_10 */
+      gimp_image_undo_disable (target_image_ID);
+      target_layer_ID = gimp_layer_new (target_image_ID, name, width, height,
+                                        gimp_drawable_type (layer_ID), 100,
+                                        GIMP_NORMAL_MODE);
+      gimp_image_insert_layer (target_image_ID, target_layer_ID, 0, -1);
+      ret = write_carver_to_layer (carver_data->carver, target_layer_ID);
+      gimp_image_undo_enable (target_image_ID);
+      gimp_display_new (target_image_ID);
+      break;
+
+    default:
+      target_layer_ID = gimp_layer_new (image_ID, name, width, height,
+                                        gimp_drawable_type (layer_ID), 100,
+                                        GIMP_NORMAL_MODE);
+      gimp_image_insert_layer (image_ID, target_layer_ID, 0, -1);
+      gimp_drawable_offsets (layer_ID, &x_off, &y_off);
+      gimp_layer_set_offsets (target_layer_ID, x_off, y_off);
+      ret = write_carver_to_layer (carver_data->carver, target_layer_ID);
+      break;
+    }
+
+  MEM_CHECK1 (ret);
+  return TRUE;
+}
+
+/* Inserts the size before the extension of a file name */
+static gchar *
+target_file_name (const gchar * filename, gint width, gint height)
+{
+  const gchar *dot;
+  const gchar *sep;
+
+  dot = strrchr (filename, '.');
+  sep = strrchr (filename, G_DIR_SEPARATOR);
+  if ((dot == NULL) || ((sep != NULL) && (dot < sep)))
+    {
+      return g_strdup_printf ("%s-%dx%d", filename, width, height);
+    }
+  return g_strdup_printf ("%.*s-%dx%d%s", (gint) (dot - filename), filename,
+                          width, height, dot);
+}
+
+static gboolean
+check_aux_layer_bpp (LqrCarverList ** carver_list_p, gint32 layer_ID)
+{
+  LqrCarver * aux_carver;
+  if (!layer_ID)
+    {
+      return TRUE;
+    }
+  aux_carver = lqr_carver_list_current (*carver_list_p);
+  BPP_CHECK (layer_ID, aux_carver);
+  *carver_list_p = lqr_carver_list_next (*carver_list_p);
+  return TRUE;
 }
 
 static gboolean copy_aux_layer_to_new_image (gint32 image_ID, gint32 * layer_ID_p, gint x_off, gint y_off)
@@ -879,7 +2399,7 @@ resize_unlock_aux_layer (gint32 layer_ID, gint width, gint height, gint x_off, g
 }
 
 static LqrCarver*
-attach_aux_carver (LqrCarver * carver, gint32 layer_ID, gint width, gint height)
+attach_aux_carver (LqrCarver * carver, gint32 layer_ID, gint width, gint height, GHashTable * layer_cache)
 {
   guchar *rgb_buffer;
   LqrCarver * aux_carver;
@@ -887,11 +2407,12 @@ attach_aux_carver (LqrCarver * carver, gint32 layer_ID, gint width, gint height)
 
   if (layer_ID)
     {
-      rgb_buffer = rgb_buffer_from_layer (layer_ID);
+      /* the aux carver takes the ownership of the buffer */
+      rgb_buffer = layer_cache_steal (layer_cache, layer_ID);
       MEM_CHECK_N (rgb_buffer);
-      bpp = gimp_drawable_bpp (layer_ID);
+      bpp = layer_channels (layer_ID);
       aux_carver =
-        lqr_carver_new (rgb_buffer, width, height, bpp);
+        carver_new_from_buffer (rgb_buffer, width, height, bpp, LQR_COLDEPTH_8I);
 
       MEM_CHECK_N (aux_carver);
       MEM_CHECK1_N (lqr_carver_attach (carver, aux_carver));
@@ -899,6 +2420,188 @@ attach_aux_carver (LqrCarver * carver, gint32 layer_ID, gint width, gint height)
   return carver;
 }
 
+/* Returns the layers to be carved along with the active one: the
+ * top level layers of the image (only the linked ones, if so
+ * chosen), except the active layer itself, the layers used as
+ * masks and the layer groups */
+static gint32 *
+other_layers_collect (gint32 image_ID, gint32 layer_ID, PlugInVals * vals, gint * n_layers)
+{
+  gint *layers;
+  gint32 *other_layers;
+  gint num_layers;
+  gint i;
+
+  *n_layers = 0;
+  layers = gimp_image_get_layers (image_ID, &num_layers);
+  other_layers = g_new (gint32, MAX (num_layers, 1));
+  for (i = 0; i < num_layers; i++)
+    {
+      if ((layers[i] == layer_ID) || (layers[i] == vals->pres_layer_ID) ||
+          (layers[i] == vals->disc_layer_ID) || (layers[i] == vals->rigmask_layer_ID) ||
+          gimp_item_is_group (layers[i]) || gimp_layer_is_floating_sel (layers[i]))
+        {
+          continue;
+        }
+      if ((vals->other_layers == OTHER_LAYERS_LINKED) && !gimp_item_get_linked (layers[i]))
+        {
+          continue;
+        }
+      other_layers[(*n_layers)++] = layers[i];
+    }
+  g_free (layers);
+
+  return other_layers;
+}
+
+/* Stores in layers (if not NULL) the plain layers found, at any
+ * depth, in a layer group, except for those used as masks, from
+ * top to bottom; returns their number */
+static gint
+group_layers_collect (gint32 group_ID, PlugInVals * vals, gint32 * layers)
+{
+  gint *children;
+  gint num_children;
+  gint i, n = 0;
+
+  children = gimp_item_get_children (group_ID, &num_children);
+  for (i = 0; i < num_children; i++)
+    {
+      if (gimp_item_is_group (children[i]))
+        {
+          n += group_layers_collect (children[i], vals, layers ? layers + n : NULL);
+        }
+      else if ((children[i] != vals->pres_layer_ID) &&
+               (children[i] != vals->disc_layer_ID) &&
+               (children[i] != vals->rigmask_layer_ID))
+        {
+          if (layers)
+            {
+              layers[n] = children[i];
+            }
+          n++;
+        }
+    }
+  g_free (children);
+
+  return n;
+}
+
+/* Returns the plain layer with the given name, at any depth, in a
+ * layer group, or -1; pos is increased by the number of plain layers
+ * which come before it, from top to bottom */
+static gint32
+group_layer_find (gint32 group_ID, const gchar * name, gint * pos)
+{
+  gint *children;
+  gint num_children;
+  gint i;
+  gint32 found = -1;
+  gchar *child_name;
+
+  children = gimp_item_get_children (group_ID, &num_children);
+  for (i = 0; (i < num_children) && (found == -1); i++)
+    {
+      if (gimp_item_is_group (children[i]))
+        {
+          found = group_layer_find (children[i], name, pos);
+          continue;
+        }
+      child_name = gimp_drawable_get_name (children[i]);
+      if (strcmp (child_name, name) == 0)
+        {
+          found = children[i];
+        }
+      else
+        {
+          (*pos)++;
+        }
+      g_free (child_name);
+    }
+  g_free (children);
+
+  return found;
+}
+
+/* Returns the plain layer which group_layer_find found at pos, in
+ * this group or in a copy of it; pos is used up along the way */
+static gint32
+group_layer_nth (gint32 group_ID, gint * pos)
+{
+  gint *children;
+  gint num_children;
+  gint i;
+  gint32 found = -1;
+
+  children = gimp_item_get_children (group_ID, &num_children);
+  for (i = 0; (i < num_children) && (found == -1); i++)
+    {
+      if (gimp_item_is_group (children[i]))
+        {
+          found = group_layer_nth (children[i], pos);
+        }
+      else if (*pos == 0)
+        {
+          found = children[i];
+        }
+      else
+        {
+          (*pos)--;
+        }
+    }
+  g_free (children);
+
+  return found;
+}
+
+static LqrCarver*
+attach_other_carver (LqrCarver * carver, gint32 layer_ID, gint width, gint height)
+{
+  gpointer buffer;
+  LqrColDepth col_depth;
+  LqrCarver * aux_carver;
+
+  /* unlike the masks, the layers are carved in their own precision */
+  buffer = native_buffer_from_layer (layer_ID, &col_depth);
+  MEM_CHECK_N (buffer);
+  aux_carver = carver_new_from_buffer (buffer, width, height, layer_channels (layer_ID), col_depth);
+  MEM_CHECK_N (aux_carver);
+  MEM_CHECK1_N (lqr_carver_attach (carver, aux_carver));
+  return carver;
+}
+
+/* Takes back the layers, or the image, made for the output target
+ * when the carver could not be set up after all */
+static void
+output_copies_remove (PlugInVals * vals, gint32 image_ID, gint32 display_ID, gint32 layer_ID,
+                      gint32 group_ID, gint32 * other_layers, gint n_other_layers)
+{
+  gint i;
+
+  switch (vals->output_target)
+    {
+    case OUTPUT_TARGET_NEW_LAYER:
+      /* the children of a group copy go along with it */
+      if (group_ID)
+        {
+          gimp_image_remove_layer (image_ID, group_ID);
+          break;
+        }
+      for (i = 0; i < n_other_layers; i++)
+        {
+          gimp_image_remove_layer (image_ID, other_layers[i]);
+        }
+      gimp_image_remove_layer (image_ID, layer_ID);
+      break;
+    case OUTPUT_TARGET_NEW_IMAGE:
+      /* the image goes with its last display */
+      gimp_display_delete (display_ID);
+      break;
+    default:
+      break;
+    }
+}
+
 static gboolean
 write_aux_carver (LqrCarverList ** carver_list_p, gint32 layer_ID, gint width, gint height)
 {
@@ -34,6 +34,13 @@ typedef struct
   gint orientation;
   gint depth;
   gfloat enl_step;
+  gchar *seam_cache_key;
+  gboolean seam_cache_hit;
+  gint32 source_layer_ID;
+  gint32 group_ID;
+  gint n_other_layers;
+  gint32 *other_layers;
+  gboolean *other_alpha_locks;
 } CarverData;
 
 #define CARVER_DATA(data) ((CarverData*)data)
@@ -66,4 +73,20 @@ render_dump_vmap (PlugInVals * vals,
         CarverData * carver_data,
         gint32 * vmap_layer_ID_p);
 
+gboolean
+render_apply_vmap (PlugInImageVals * image_vals,
+        PlugInDrawableVals * drawable_vals,
+        PlugInVals * vals,
+        gint32 vmap_layer_ID);
+
+gboolean
+render_stripes_wanted (PlugInImageVals * image_vals,
+        PlugInDrawableVals * drawable_vals,
+        PlugInVals * vals);
+
+gboolean
+render_stripes (PlugInImageVals * image_vals,
+        PlugInDrawableVals * drawable_vals,
+        PlugInVals * vals);
+
 #endif /* __RENDER_H__ */
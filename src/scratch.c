@@ -0,0 +1,243 @@
+/* GIMP LiquidRescale Plug-in
+ * Copyright (C) 2007-2010 Carlo Baldassi (the "Author") <carlobaldassi@gmail.com>.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the Licence, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org.licences/>.
+ */
+
+#include "config.h"
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#ifdef G_OS_UNIX
+#  include <fcntl.h>
+#  include <unistd.h>
+#  include <sys/mman.h>
+#  if defined (_POSIX_MAPPED_FILES) && (_POSIX_MAPPED_FILES > 0) && \
+      defined (_POSIX_ADVISORY_INFO) && (_POSIX_ADVISORY_INFO > 0)
+#    define SCRATCH_MMAP
+#  endif
+#endif /* G_OS_UNIX */
+
+#include "scratch.h"
+
+/* Buffers smaller than this stay on the heap */
+#define SCRATCH_MIN_SIZE (1 << 20)
+
+typedef struct
+{
+  gpointer mem;
+  gsize size;
+  gboolean lent;
+} ScratchMap;
+
+static gchar *scratch_dir = NULL;
+static GSList *scratch_maps = NULL;
+
+/* static functions declarations */
+
+#ifdef SCRATCH_MMAP
+static gpointer scratch_map (gsize size);
+#endif /* SCRATCH_MMAP */
+static ScratchMap * scratch_lookup (gconstpointer mem);
+static void scratch_release (ScratchMap * map);
+
+
+/* Sets the directory where the buffers are to be mapped;
+ * NULL or empty to keep them on the heap */
+void
+scratch_set_dir (const gchar * dir)
+{
+  g_free (scratch_dir);
+  scratch_dir = ((dir != NULL) && (dir[0] != '\0')) ? g_strdup (dir) : NULL;
+}
+
+/* Whether large buffers are being mapped */
+gboolean
+scratch_enabled (void)
+{
+#ifdef SCRATCH_MMAP
+  return (scratch_dir != NULL);
+#else
+  return FALSE;
+#endif /* SCRATCH_MMAP */
+}
+
+/* Allocates size bytes, mapped from a file in the scratch directory
+ * if there is one, or else (or if that fails) from the heap */
+gpointer
+scratch_alloc (gsize size)
+{
+#ifdef SCRATCH_MMAP
+  gpointer mem;
+
+  if ((scratch_dir != NULL) && (size >= SCRATCH_MIN_SIZE))
+    {
+      mem = scratch_map (size);
+      if (mem != NULL)
+        {
+          return mem;
+        }
+    }
+#endif /* SCRATCH_MMAP */
+
+  return g_try_malloc (size);
+}
+
+gboolean
+scratch_is_mapped (gconstpointer mem)
+{
+  return (mem != NULL) && (scratch_lookup (mem) != NULL);
+}
+
+/* Frees a buffer which was not given to a carver */
+void
+scratch_free (gpointer mem)
+{
+  ScratchMap *map;
+
+  map = scratch_lookup (mem);
+  if (map != NULL)
+    {
+      scratch_release (map);
+    }
+  else
+    {
+      g_free (mem);
+    }
+}
+
+/* Records that a mapped buffer went to a carver which was told,
+ * with lqr_carver_set_preserve_input_image, not to free it */
+void
+scratch_lend (gpointer mem)
+{
+  ScratchMap *map;
+
+  map = scratch_lookup (mem);
+  if (map != NULL)
+    {
+      map->lent = TRUE;
+    }
+}
+
+/* Gives a mapped buffer back to the system, once its carver is gone;
+ * heap buffers are left alone, since they go along with the carver.
+ * A mapped buffer must have been lent: a carver which owned it would
+ * already have freed it as if it were on the heap */
+void
+scratch_unmap (gpointer mem)
+{
+  ScratchMap *map;
+
+  map = scratch_lookup (mem);
+  if (map == NULL)
+    {
+      return;
+    }
+
+  g_assert (map->lent);
+  scratch_release (map);
+}
+
+/* Unmaps all the buffers which are left, at the end of a run */
+void
+scratch_free_all (void)
+{
+  while (scratch_maps != NULL)
+    {
+      scratch_release (scratch_maps->data);
+    }
+}
+
+#ifdef SCRATCH_MMAP
+/* Maps a new file, which is unlinked right away, so that it goes
+ * along with the mapping; its blocks are reserved beforehand, as
+ * running out of disk space while writing to the mapping would
+ * kill the plug-in */
+static gpointer
+scratch_map (gsize size)
+{
+  ScratchMap *map;
+  gchar *filename;
+  gpointer mem;
+  gint fd;
+
+  filename = g_build_filename (scratch_dir, "gimp-lqr-XXXXXX", NULL);
+  fd = g_mkstemp (filename);
+  if (fd < 0)
+    {
+      g_free (filename);
+      return NULL;
+    }
+  g_unlink (filename);
+  g_free (filename);
+
+  if (posix_fallocate (fd, 0, size) != 0)
+    {
+      close (fd);
+      return NULL;
+    }
+
+  mem = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close (fd);
+  if (mem == MAP_FAILED)
+    {
+      return NULL;
+    }
+
+  /* the pixels are read in, and written out, line after line */
+  posix_madvise (mem, size, POSIX_MADV_SEQUENTIAL);
+
+  map = g_new (ScratchMap, 1);
+  map->mem = mem;
+  map->size = size;
+  map->lent = FALSE;
+  scratch_maps = g_slist_prepend (scratch_maps, map);
+
+  return mem;
+}
+#endif /* SCRATCH_MMAP */
+
+static ScratchMap *
+scratch_lookup (gconstpointer mem)
+{
+  GSList *l;
+
+  for (l = scratch_maps; l != NULL; l = l->next)
+    {
+      if (((ScratchMap *) l->data)->mem == mem)
+        {
+          return l->data;
+        }
+    }
+
+  return NULL;
+}
+
+static void
+scratch_release (ScratchMap * map)
+{
+#ifdef SCRATCH_MMAP
+  /* the pages are dropped, rather than written out to a file
+   * which is about to go */
+#ifdef MADV_DONTNEED
+  madvise (map->mem, map->size, MADV_DONTNEED);
+#endif /* MADV_DONTNEED */
+  munmap (map->mem, map->size);
+#endif /* SCRATCH_MMAP */
+  scratch_maps = g_slist_remove (scratch_maps, map);
+  g_free (map);
+}
@@ -0,0 +1,39 @@
+/* GIMP LiquidRescale Plug-in
+ * Copyright (C) 2007-2010 Carlo Baldassi (the "Author") <carlobaldassi@gmail.com>.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the Licence, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org.licences/>.
+ */
+
+#ifndef __SCRATCH_H__
+#define __SCRATCH_H__
+
+/* Large pixel buffers can be placed in files mapped under a scratch
+ * directory, rather than on the heap, so that the system pages them
+ * out to those files, instead of swapping or killing the plug-in,
+ * when memory runs short. A carver made from such a buffer must be
+ * kept from freeing it, with lqr_carver_set_preserve_input_image,
+ * and the buffer marked with scratch_lend: it is then given back
+ * with scratch_unmap, or by scratch_free_all */
+
+void scratch_set_dir (const gchar * dir);
+gboolean scratch_enabled (void);
+gpointer scratch_alloc (gsize size);
+gboolean scratch_is_mapped (gconstpointer mem);
+void scratch_free (gpointer mem);
+void scratch_lend (gpointer mem);
+void scratch_unmap (gpointer mem);
+void scratch_free_all (void);
+
+#endif /* __SCRATCH_H__ */
@@ -0,0 +1,565 @@
+/* GIMP LiquidRescale Plug-in
+ * Copyright (C) 2007-2010 Carlo Baldassi (the "Author") <carlobaldassi@gmail.com>.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the Licence, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org.licences/>.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <glib/gstdio.h>
+#include <libgimp/gimp.h>
+#include <lqr.h>
+
+#include "main_common.h"
+#include "seam_cache.h"
+
+/* The cache files start with this tag, followed by the width, height,
+ * depth and orientation of the map and by the size of the packed map
+ * (as big-endian guint32 values), and then by the map, packed by
+ * vmap_pack; the tag must change along with the layout */
+#define SEAM_CACHE_MAGIC "LQRVMAP2"
+#define SEAM_CACHE_DIR "gimp-lqr-plugin"
+
+/* Total size of the cache files, past which the least recently
+ * used ones are removed */
+#define SEAM_CACHE_MAX_SIZE ((goffset) 256 << 20)
+
+/* The layer parasites hold the key, then the width, height, depth
+ * and orientation (as big-endian guint32 values) and the packed map */
+#define SEAM_PARASITE_KEY_LENGTH (40)
+#define SEAM_PARASITE_HEADER_SIZE (SEAM_PARASITE_KEY_LENGTH + 4 * sizeof (guint32))
+
+/* A cache file, as seen when trimming the cache */
+typedef struct
+{
+  gchar *path;
+  goffset size;
+  gint64 mtime;
+} SeamCacheFile;
+
+static gchar *seam_cache_path (const gchar * key, const gchar * suffix);
+static void seam_cache_trim (const gchar * keep);
+static gint seam_cache_file_compare (gconstpointer a, gconstpointer b);
+static void seam_cache_file_free (gpointer file);
+static gsize vmap_pack (const gint * data, gsize size, guchar * dest);
+static gboolean vmap_unpack (const guchar * src, gsize src_size, gint * data, gsize size);
+static gsize varint_put (guchar * dest, guint32 value);
+static gboolean varint_get (const guchar ** src_p, const guchar * end, guint32 * value);
+
+
+void
+seam_cache_hash_int (GChecksum * checksum, gint value)
+{
+  gint32 v = value;
+
+  g_checksum_update (checksum, (const guchar *) &v, sizeof (v));
+}
+
+void
+seam_cache_hash_double (GChecksum * checksum, gdouble value)
+{
+  g_checksum_update (checksum, (const guchar *) &value, sizeof (value));
+}
+
+void
+seam_cache_hash_data (GChecksum * checksum, gconstpointer data, gsize size)
+{
+  g_checksum_update (checksum, data, size);
+}
+
+/* Returns the cached map for the given key, or NULL if there is
+ * none which matches the carver and is at least min_depth deep */
+LqrVMap *
+seam_cache_lookup (const gchar * key, gint width, gint height,
+                   gint orientation, gint min_depth)
+{
+  FILE *fp;
+  gchar *path;
+  gchar magic[sizeof (SEAM_CACHE_MAGIC) - 1];
+  guint32 header[5];
+  guchar *packed = NULL;
+  gint *data = NULL;
+  gsize size;
+  gint i;
+  LqrVMap *vmap = NULL;
+
+  path = seam_cache_path (key, NULL);
+  fp = g_fopen (path, "rb");
+  if (fp == NULL)
+    {
+      g_free (path);
+      return NULL;
+    }
+
+  if ((fread (magic, sizeof (magic), 1, fp) != 1) ||
+      (memcmp (magic, SEAM_CACHE_MAGIC, sizeof (magic)) != 0) ||
+      (fread (header, sizeof (header), 1, fp) != 1))
+    {
+      fclose (fp);
+      g_free (path);
+      return NULL;
+    }
+  for (i = 0; i < 5; i++)
+    {
+      header[i] = GUINT32_FROM_BE (header[i]);
+    }
+
+  if ((header[0] == (guint32) width) && (header[1] == (guint32) height) &&
+      (header[2] >= (guint32) min_depth) && (header[3] == (guint32) orientation))
+    {
+      size = (gsize) width * height;
+      packed = g_try_malloc (header[4]);
+      data = g_try_new (gint, size);
+      if ((packed != NULL) && (data != NULL) &&
+          (fread (packed, 1, header[4], fp) == header[4]) &&
+          vmap_unpack (packed, header[4], data, size))
+        {
+          vmap = lqr_vmap_new (data, width, height, header[2], orientation);
+        }
+      if (vmap == NULL)
+        {
+          g_free (data);
+        }
+      g_free (packed);
+    }
+
+  fclose (fp);
+
+  /* a hit counts as a use, which keeps the file from the trimming */
+  if (vmap != NULL)
+    {
+      g_utime (path, NULL);
+    }
+  g_free (path);
+
+  return vmap;
+}
+
+/* Stores a map under the given key; the file is written aside and
+ * then renamed, so that concurrent runs never see a partial one.
+ * The least recently used files then go, until the cache fits in
+ * SEAM_CACHE_MAX_SIZE */
+gboolean
+seam_cache_store (const gchar * key, LqrVMap * vmap)
+{
+  FILE *fp;
+  gchar *dir;
+  gchar *path;
+  gchar *tmp_path;
+  guint32 header[5];
+  const gint *data;
+  guchar *packed;
+  gsize size;
+  gsize packed_size;
+  gint i;
+  gboolean ok;
+
+  data = lqr_vmap_get_data (vmap);
+  size = (gsize) lqr_vmap_get_width (vmap) * lqr_vmap_get_height (vmap);
+
+  /* the first pass only measures; a map which would not fit
+   * in the cache by itself is not stored */
+  packed_size = vmap_pack (data, size, NULL);
+  if (packed_size + sizeof (SEAM_CACHE_MAGIC) + sizeof (header) > SEAM_CACHE_MAX_SIZE)
+    {
+      return FALSE;
+    }
+
+  dir = g_build_filename (g_get_user_cache_dir (), SEAM_CACHE_DIR, NULL);
+  ok = (g_mkdir_with_parents (dir, 0700) == 0);
+  g_free (dir);
+  if (!ok)
+    {
+      return FALSE;
+    }
+
+  packed = g_try_malloc (packed_size);
+  if (packed == NULL)
+    {
+      return FALSE;
+    }
+  vmap_pack (data, size, packed);
+
+  header[0] = lqr_vmap_get_width (vmap);
+  header[1] = lqr_vmap_get_height (vmap);
+  header[2] = lqr_vmap_get_depth (vmap);
+  header[3] = lqr_vmap_get_orientation (vmap);
+  header[4] = packed_size;
+  for (i = 0; i < 5; i++)
+    {
+      header[i] = GUINT32_TO_BE (header[i]);
+    }
+
+  tmp_path = seam_cache_path (key, ".part");
+  fp = g_fopen (tmp_path, "wb");
+  if (fp == NULL)
+    {
+      g_free (packed);
+      g_free (tmp_path);
+      return FALSE;
+    }
+
+  ok = (fwrite (SEAM_CACHE_MAGIC, sizeof (SEAM_CACHE_MAGIC) - 1, 1, fp) == 1) &&
+    (fwrite (header, sizeof (header), 1, fp) == 1) &&
+    (fwrite (packed, 1, packed_size, fp) == packed_size);
+  ok = (fclose (fp) == 0) && ok;
+  g_free (packed);
+
+  path = seam_cache_path (key, NULL);
+  if (ok)
+    {
+      ok = (g_rename (tmp_path, path) == 0);
+    }
+  if (ok)
+    {
+      seam_cache_trim (path);
+    }
+  else
+    {
+      g_unlink (tmp_path);
+    }
+  g_free (path);
+  g_free (tmp_path);
+
+  return ok;
+}
+
+/* Same as seam_cache_lookup, but the map is taken from the layer
+ * itself; a parasite with a different key was stored before the
+ * layer (or the masks, or the parameters) changed, and is ignored */
+LqrVMap *
+seam_cache_lookup_parasite (gint32 layer_ID, const gchar * key, gint width,
+                            gint height, gint orientation, gint min_depth)
+{
+  GimpParasite *parasite;
+  const guchar *src;
+  guint32 header[4];
+  gsize src_size;
+  gsize size;
+  gint *data = NULL;
+  gint i;
+  LqrVMap *vmap = NULL;
+
+  if (strlen (key) != SEAM_PARASITE_KEY_LENGTH)
+    {
+      return NULL;
+    }
+
+  parasite = gimp_item_get_parasite (layer_ID, PARASITE_VMAP_KEY);
+  if (parasite == NULL)
+    {
+      return NULL;
+    }
+
+  src = gimp_parasite_data (parasite);
+  src_size = gimp_parasite_data_size (parasite);
+  if ((src_size < SEAM_PARASITE_HEADER_SIZE) ||
+      (memcmp (src, key, SEAM_PARASITE_KEY_LENGTH) != 0))
+    {
+      gimp_parasite_free (parasite);
+      return NULL;
+    }
+
+  memcpy (header, src + SEAM_PARASITE_KEY_LENGTH, sizeof (header));
+  for (i = 0; i < 4; i++)
+    {
+      header[i] = GUINT32_FROM_BE (header[i]);
+    }
+
+  if ((header[0] == (guint32) width) && (header[1] == (guint32) height) &&
+      (header[2] >= (guint32) min_depth) && (header[3] == (guint32) orientation))
+    {
+      size = (gsize) width * height;
+      data = g_try_new (gint, size);
+      if ((data != NULL) &&
+          vmap_unpack (src + SEAM_PARASITE_HEADER_SIZE,
+                       src_size - SEAM_PARASITE_HEADER_SIZE, data, size))
+        {
+          vmap = lqr_vmap_new (data, width, height, header[2], orientation);
+        }
+      if (vmap == NULL)
+        {
+          g_free (data);
+        }
+    }
+
+  gimp_parasite_free (parasite);
+
+  return vmap;
+}
+
+/* Attaches a map to the layer, replacing any earlier one; the
+ * parasite is saved with the image and follows undo */
+gboolean
+seam_cache_store_parasite (gint32 layer_ID, const gchar * key, LqrVMap * vmap)
+{
+  GimpParasite *parasite;
+  guchar *buf;
+  guint32 header[4];
+  const gint *data;
+  gsize size;
+  gsize packed_size;
+  gint i;
+  gboolean ok;
+
+  if (strlen (key) != SEAM_PARASITE_KEY_LENGTH)
+    {
+      return FALSE;
+    }
+
+  header[0] = lqr_vmap_get_width (vmap);
+  header[1] = lqr_vmap_get_height (vmap);
+  header[2] = lqr_vmap_get_depth (vmap);
+  header[3] = lqr_vmap_get_orientation (vmap);
+  for (i = 0; i < 4; i++)
+    {
+      header[i] = GUINT32_TO_BE (header[i]);
+    }
+
+  data = lqr_vmap_get_data (vmap);
+  size = (gsize) lqr_vmap_get_width (vmap) * lqr_vmap_get_height (vmap);
+
+  /* the first pass only measures */
+  packed_size = vmap_pack (data, size, NULL);
+  if (packed_size > G_MAXUINT32 - SEAM_PARASITE_HEADER_SIZE)
+    {
+      return FALSE;
+    }
+  buf = g_try_malloc (SEAM_PARASITE_HEADER_SIZE + packed_size);
+  if (buf == NULL)
+    {
+      return FALSE;
+    }
+
+  memcpy (buf, key, SEAM_PARASITE_KEY_LENGTH);
+  memcpy (buf + SEAM_PARASITE_KEY_LENGTH, header, sizeof (header));
+  vmap_pack (data, size, buf + SEAM_PARASITE_HEADER_SIZE);
+
+  parasite = gimp_parasite_new (PARASITE_VMAP_KEY,
+                                GIMP_PARASITE_PERSISTENT | GIMP_PARASITE_UNDOABLE,
+                                SEAM_PARASITE_HEADER_SIZE + packed_size, buf);
+  g_free (buf);
+  if (parasite == NULL)
+    {
+      return FALSE;
+    }
+  ok = gimp_item_attach_parasite (layer_ID, parasite);
+  gimp_parasite_free (parasite);
+
+  return ok;
+}
+
+static gchar *
+seam_cache_path (const gchar * key, const gchar * suffix)
+{
+  gchar *name;
+  gchar *path;
+
+  name = g_strconcat (key, ".vmap", suffix, NULL);
+  path = g_build_filename (g_get_user_cache_dir (), SEAM_CACHE_DIR, name, NULL);
+  g_free (name);
+
+  return path;
+}
+
+/* Removes the least recently used cache files, until the rest fit in
+ * SEAM_CACHE_MAX_SIZE; the file at keep, just stored, always stays */
+static void
+seam_cache_trim (const gchar * keep)
+{
+  GDir *dir;
+  gchar *dir_path;
+  const gchar *name;
+  GSList *files = NULL;
+  GSList *l;
+  SeamCacheFile *file;
+  GStatBuf st;
+  goffset total = 0;
+
+  dir_path = g_build_filename (g_get_user_cache_dir (), SEAM_CACHE_DIR, NULL);
+  dir = g_dir_open (dir_path, 0, NULL);
+  if (dir == NULL)
+    {
+      g_free (dir_path);
+      return;
+    }
+
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      if (!g_str_has_suffix (name, ".vmap"))
+        {
+          continue;
+        }
+      file = g_new (SeamCacheFile, 1);
+      file->path = g_build_filename (dir_path, name, NULL);
+      if (g_stat (file->path, &st) != 0)
+        {
+          seam_cache_file_free (file);
+          continue;
+        }
+      file->size = st.st_size;
+      file->mtime = st.st_mtime;
+      total += file->size;
+      files = g_slist_prepend (files, file);
+    }
+  g_dir_close (dir);
+  g_free (dir_path);
+
+  files = g_slist_sort (files, seam_cache_file_compare);
+  for (l = files; (l != NULL) && (total > SEAM_CACHE_MAX_SIZE); l = l->next)
+    {
+      file = l->data;
+      if ((strcmp (file->path, keep) != 0) && (g_unlink (file->path) == 0))
+        {
+          total -= file->size;
+        }
+    }
+
+  g_slist_free_full (files, seam_cache_file_free);
+}
+
+/* Oldest first */
+static gint
+seam_cache_file_compare (gconstpointer a, gconstpointer b)
+{
+  const SeamCacheFile *fa = a;
+  const SeamCacheFile *fb = b;
+
+  return (fa->mtime > fb->mtime) - (fa->mtime < fb->mtime);
+}
+
+static void
+seam_cache_file_free (gpointer file)
+{
+  g_free (((SeamCacheFile *) file)->path);
+  g_free (file);
+}
+
+/* Packs a map as a sequence of varints: each nonzero level v
+ * becomes v + 1, and each run of zeros (the pixels which are never
+ * carved, i.e. most of them) becomes a 0 followed by its length.
+ * Returns the packed size; if dest is NULL, nothing is written */
+static gsize
+vmap_pack (const gint * data, gsize size, guchar * dest)
+{
+  gsize i;
+  gsize run;
+  gsize n = 0;
+
+  for (i = 0; i < size;)
+    {
+      if (data[i] == 0)
+        {
+          for (run = 0; (i < size) && (data[i] == 0) && (run < G_MAXUINT32); i++)
+            {
+              run++;
+            }
+          n += varint_put (dest ? dest + n : NULL, 0);
+          n += varint_put (dest ? dest + n : NULL, run);
+        }
+      else
+        {
+          n += varint_put (dest ? dest + n : NULL, (guint32) data[i] + 1);
+          i++;
+        }
+    }
+
+  return n;
+}
+
+static gboolean
+vmap_unpack (const guchar * src, gsize src_size, gint * data, gsize size)
+{
+  const guchar *end = src + src_size;
+  guint32 value;
+  guint32 run;
+  gsize i = 0;
+
+  while (src < end)
+    {
+      if (!varint_get (&src, end, &value))
+        {
+          return FALSE;
+        }
+      if (value == 0)
+        {
+          if (!varint_get (&src, end, &run) || (run > size - i))
+            {
+              return FALSE;
+            }
+          memset (data + i, 0, run * sizeof (gint));
+          i += run;
+        }
+      else
+        {
+          if ((i >= size) || (value - 1 > G_MAXINT))
+            {
+              return FALSE;
+            }
+          data[i++] = value - 1;
+        }
+    }
+
+  return (i == size);
+}
+
+static gsize
+varint_put (guchar * dest, guint32 value)
+{
+  gsize n = 0;
+  guchar byte;
+
+  do
+    {
+      byte = value & 0x7f;
+      value >>= 7;
+      if (value)
+        {
+          byte |= 0x80;
+        }
+      if (dest)
+        {
+          dest[n] = byte;
+        }
+      n++;
+    }
+  while (value);
+
+  return n;
+}
+
+static gboolean
+varint_get (const guchar ** src_p, const guchar * end, guint32 * value)
+{
+  const guchar *src = *src_p;
+  guint32 v = 0;
+  gint shift;
+
+  for (shift = 0; (src < end) && (shift < 32); shift += 7)
+    {
+      v |= (guint32) (*src & 0x7f) << shift;
+      if (!(*src++ & 0x80))
+        {
+          *value = v;
+          *src_p = src;
+          return TRUE;
+        }
+    }
+
+  return FALSE;
+}
@@ -0,0 +1,42 @@
+/* GIMP LiquidRescale Plug-in
+ * Copyright (C) 2007-2010 Carlo Baldassi (the "Author") <carlobaldassi@gmail.com>.
+ * All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the Licence, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org.licences/>.
+ */
+
+#ifndef __SEAM_CACHE_H__
+#define __SEAM_CACHE_H__
+
+/* Visibility maps computed by earlier runs are kept on disk, in the
+ * user's cache directory, under the SHA-1 of everything which they
+ * depend on (pixels, masks and carving parameters). A map of depth d
+ * can serve any later shrinking by up to d pixels in its direction.
+ * The maps are stored packed, and the least recently used ones are
+ * removed when the cache grows past a fixed size */
+
+void seam_cache_hash_int (GChecksum * checksum, gint value);
+void seam_cache_hash_double (GChecksum * checksum, gdouble value);
+void seam_cache_hash_data (GChecksum * checksum, gconstpointer data, gsize size);
+LqrVMap *seam_cache_lookup (const gchar * key, gint width, gint height,
+                            gint orientation, gint min_depth);
+gboolean seam_cache_store (const gchar * key, LqrVMap * vmap);
+
+/* The same maps can also be attached to the source layer, where
+ * they travel with the image and are undone along with the run */
+LqrVMap *seam_cache_lookup_parasite (gint32 layer_ID, const gchar * key, gint width,
+                                     gint height, gint orientation, gint min_depth);
+gboolean seam_cache_store_parasite (gint32 layer_ID, const gchar * key, LqrVMap * vmap);
+
+#endif /* __SEAM_CACHE_H__ */